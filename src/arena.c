@@ -0,0 +1,227 @@
+/*
+ * Bump allocation out of chunks that are kept from one reset to the next.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+/* Allocations are aligned as malloc's are on the systems this runs on */
+#define ARENA_ALIGN 16
+
+/* Each allocation's size is kept right in front of it, for arena_realloc */
+#define ARENA_HEADER ARENA_ALIGN
+
+#define ROUND_UP(n) (((n) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
+struct arena_chunk {
+	struct arena_chunk* next;
+	/* Bytes that can be handed out, past the header */
+	size_t size;
+};
+
+#define CHUNK_HEADER ROUND_UP(sizeof(struct arena_chunk))
+
+struct arena {
+	/* Chunks in the order they are allocated from */
+	struct arena_chunk* head;
+	/* Chunk being allocated from, pos bytes into it, NULL if there is none */
+	struct arena_chunk* cur;
+	size_t pos;
+	/* The last allocation, the only one that can grow or shrink in place */
+	char* last;
+	size_t chunksize;
+	size_t used;
+	size_t peak;
+	size_t reserved;
+};
+
+static char*
+_chunk_data(struct arena_chunk* chunk) {
+
+	return (char*) chunk + CHUNK_HEADER;
+
+}
+
+/*
+ * Moves on to a chunk with room for need bytes. Chunks kept from before the
+ * last reset are reused in order, one too small for need is left for later
+ * and a new one is put in front of it.
+ */
+static int
+_next_chunk(struct arena* arena, size_t need) {
+
+	struct arena_chunk* next;
+	struct arena_chunk* chunk;
+	size_t size;
+
+	next = arena->cur != NULL ? arena->cur->next : arena->head;
+
+	if (next != NULL && next->size >= need) {
+		arena->cur = next;
+		arena->pos = 0;
+		return 0;
+	}
+
+	size = need > arena->chunksize ? need : arena->chunksize;
+
+	if ((chunk = malloc(CHUNK_HEADER + size)) == NULL) {
+		return -1;
+	}
+
+	chunk->size = size;
+	chunk->next = next;
+
+	if (arena->cur != NULL) {
+		arena->cur->next = chunk;
+	} else {
+		arena->head = chunk;
+	}
+
+	arena->cur = chunk;
+	arena->pos = 0;
+	arena->reserved += size;
+
+	return 0;
+
+}
+
+struct arena*
+arena_new(size_t chunksize) {
+
+	struct arena* arena;
+
+	if ((arena = calloc(1, sizeof(struct arena))) == NULL) {
+		return NULL;
+	}
+
+	arena->chunksize = ROUND_UP(chunksize);
+
+	return arena;
+
+}
+
+void*
+arena_alloc(struct arena* arena, size_t size) {
+
+	size_t need = ARENA_HEADER + ROUND_UP(size);
+	char* p;
+
+	if (size > SIZE_MAX - 2 * ARENA_ALIGN) {
+		return NULL;
+	}
+
+	if ((arena->cur == NULL || arena->pos + need > arena->cur->size)
+		&& _next_chunk(arena, need) == -1) {
+		return NULL;
+	}
+
+	p = _chunk_data(arena->cur) + arena->pos;
+	*(size_t*) p = size;
+
+	arena->pos += need;
+	arena->last = p + ARENA_HEADER;
+	arena->used += need;
+
+	if (arena->used > arena->peak) {
+		arena->peak = arena->used;
+	}
+
+	return arena->last;
+
+}
+
+void*
+arena_realloc(struct arena* arena, void* ptr, size_t size) {
+
+	size_t oldsize, oldneed, need;
+	void* moved;
+
+	if (ptr == NULL) {
+		return arena_alloc(arena, size);
+	}
+
+	oldsize = *(size_t*) ((char*) ptr - ARENA_HEADER);
+
+	if (ptr == arena->last && size <= SIZE_MAX - 2 * ARENA_ALIGN) {
+
+		oldneed = ARENA_HEADER + ROUND_UP(oldsize);
+		need = ARENA_HEADER + ROUND_UP(size);
+
+		if (arena->pos - oldneed + need <= arena->cur->size) {
+			*(size_t*) ((char*) ptr - ARENA_HEADER) = size;
+			arena->pos = arena->pos - oldneed + need;
+			arena->used = arena->used - oldneed + need;
+			if (arena->used > arena->peak) {
+				arena->peak = arena->used;
+			}
+			return ptr;
+		}
+
+	}
+
+	if (size <= oldsize) {
+		return ptr;
+	}
+
+	if ((moved = arena_alloc(arena, size)) == NULL) {
+		return NULL;
+	}
+
+	memcpy(moved, ptr, oldsize);
+
+	return moved;
+
+}
+
+void
+arena_release(struct arena* arena, void* ptr) {
+
+	size_t need;
+
+	if (ptr == NULL || ptr != arena->last) {
+		return;
+	}
+
+	need = ARENA_HEADER + ROUND_UP(*(size_t*) ((char*) ptr - ARENA_HEADER));
+
+	arena->pos -= need;
+	arena->used -= need;
+	arena->last = NULL;
+
+}
+
+void
+arena_reset(struct arena* arena) {
+
+	arena->cur = NULL;
+	arena->pos = 0;
+	arena->last = NULL;
+	arena->used = 0;
+
+}
+
+void
+arena_stats(struct arena* arena, struct arena_stats* stats) {
+
+	stats->used = arena->used;
+	stats->peak = arena->peak;
+	stats->reserved = arena->reserved;
+
+}
+
+void
+arena_free(struct arena* arena) {
+
+	struct arena_chunk* next;
+
+	for (struct arena_chunk* chunk = arena->head; chunk != NULL;
+		chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
+	free(arena);
+
+}
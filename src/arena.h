@@ -0,0 +1,56 @@
+/*
+ * Bump allocation for what lives exactly as long as an epub is open. Memory is
+ * handed out of large chunks in order and never given back piece by piece,
+ * the whole arena is reset at once instead, keeping its chunks for whatever is
+ * allocated next.
+ */
+
+/* An arena, see arena_new. */
+struct arena;
+
+/* How much of an arena is in use, see arena_stats */
+struct arena_stats {
+	/* Bytes handed out since the arena was last reset */
+	size_t used;
+	/* Most bytes that were ever handed out at once */
+	size_t peak;
+	/* Bytes in the arena's chunks, whether handed out or not */
+	size_t reserved;
+};
+
+/*
+ * Makes an empty arena, which takes chunks of chunksize bytes from malloc as
+ * it needs them. Returns NULL if memory could not be allocated.
+ */
+/* NOTE: Should be freed using arena_free when no longer in use. */
+struct arena* arena_new(size_t chunksize);
+
+/*
+ * Hands out size bytes, aligned for anything, as malloc would. Returns NULL
+ * if memory could not be allocated.
+ */
+void* arena_alloc(struct arena* arena, size_t size);
+
+/*
+ * Resizes ptr, as realloc would. The last allocation grows in place if there
+ * is room left in its chunk, anything else is copied.
+ */
+void* arena_realloc(struct arena* arena, void* ptr, size_t size);
+
+/*
+ * Gives ptr back. Only the last allocation is actually reused, anything else
+ * is only reused once the arena is reset.
+ */
+void arena_release(struct arena* arena, void* ptr);
+
+/*
+ * Makes every chunk free for allocating from again, at once. Everything
+ * handed out before is gone.
+ */
+void arena_reset(struct arena* arena);
+
+/* Fills stats in with how much of arena is in use */
+void arena_stats(struct arena* arena, struct arena_stats* stats);
+
+/* Frees an arena made with arena_new, along with everything in it */
+void arena_free(struct arena* arena);
@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <limits.h>
+#include <sys/stat.h>
 
 #include "ebread.h"
 #include "epub.h"
@@ -15,13 +16,16 @@
 
 #define PATHMAX 4096
 
-/* Length of /tmp/ebread.XXXXXX/ */
-#define TMPDIRLEN 18
+/* Most threads -t will start */
+#define MAX_THREADS 256
 
 static void
 _print_usage(void) {
 
-	printf("Usage: ebread [-oxqhuv] [-1 file] [-d dir] [-n name] [-i num] [-l num] EPUB\n");
+	printf("Usage: ebread [-ocrxLjkmDqhuv] [-1 file] [-d dir] [-n name] [-i num] [-l num]\n"
+	       "              [-t num] [-I glob] [-E glob] [-S size] [-T size] [-R num]\n"
+	       "              [-P file] [-z num] [-s dir]\n"
+	       "              EPUB\n");
 
 }
 
@@ -44,7 +48,23 @@ _print_help(void) {
 	printf(" -i <num>   --indent=<num>              Set output indent size (default is 4).\n");
 	printf(" -l <num>   --line-length=<num>         Set output line length (default is 80).\n");
 	printf(" -o         --stdout                    Write parsed text to stdout.\n");
+	printf(" -c         --crc-rendered              Only check the CRC-32 of rendered files.\n");
+	printf(" -r         --recover                   Ignore the central directory.\n");
 	printf(" -x         --extract                   Extract epub contents, do no parsing.\n");
+	printf(" -L         --list                      List epub contents, do no parsing.\n");
+	printf(" -j         --json                      List epub contents as JSON.\n");
+	printf(" -k         --test                      Check epub contents, write nothing.\n");
+	printf(" -t <num>   --threads=<num>             Inflate on num threads (default is 1).\n");
+	printf(" -I <glob>  --include=<glob>            Only extract files matching glob.\n");
+	printf(" -E <glob>  --exclude=<glob>            Do not extract files matching glob.\n");
+	printf(" -m         --skip-media                Do not extract images, fonts or media.\n");
+	printf(" -s <dir>   --store=<dir>               Share extracted files through dir.\n");
+	printf(" -S <size>  --max-entry-size=<size>     Fail on files inflating past size.\n");
+	printf(" -T <size>  --max-size=<size>           Fail once the epub inflates past size.\n");
+	printf(" -R <num>   --max-ratio=<num>           Fail on files inflating num times over.\n");
+	printf(" -P <file>  --repack=<file>             Recompress epub into file, do no parsing.\n");
+	printf(" -z <num>   --level=<num>               Set repack compression level (default is 9).\n");
+	printf(" -D         --drop-unreferenced         Do not repack files the manifest omits.\n");
 	printf(" -q         --quiet                     Disable verbose output.\n");
 	printf(" -h         --help                      Print this help message.\n");
 	printf(" -u         --usage                     Print usage message.\n");
@@ -52,6 +72,75 @@ _print_help(void) {
 
 }
 
+/*
+ * Adds glob to the NULL-terminated globs, which is made on first use with room
+ * for every one of argc arguments.
+ */
+static int
+_add_glob(char*** globs, int argc, char* glob) {
+
+	int n = 0;
+
+	if (*globs == NULL && (*globs = calloc(argc + 1, sizeof(char*))) == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		return -1;
+	}
+
+	while ((*globs)[n] != NULL) {
+		n++;
+	}
+
+	(*globs)[n] = glob;
+
+	return 0;
+
+}
+
+/*
+ * Reads a size in bytes, optionally followed by a K, M or G suffix. Returns -1
+ * if arg is not one.
+ */
+static int
+_parse_size(char* arg, unsigned long* size) {
+
+	char* end;
+	int shift = 0;
+
+	*size = strtoul(arg, &end, 10);
+
+	if (end == arg || *size == ULONG_MAX) {
+		fprintf(stderr, "Invalid size: %s\n", arg);
+		return -1;
+	}
+
+	switch (*end) {
+	case '\0':
+		break;
+	case 'k': case 'K':
+		shift = 10;
+		break;
+	case 'm': case 'M':
+		shift = 20;
+		break;
+	case 'g': case 'G':
+		shift = 30;
+		break;
+	default:
+		fprintf(stderr, "Invalid size: %s\n", arg);
+		return -1;
+	}
+
+	if (*end != '\0' && (end[1] != '\0' || *size > ULONG_MAX >> shift)) {
+		fprintf(stderr, "Invalid size: %s\n", arg);
+		return -1;
+	}
+
+	*size <<= shift;
+
+	return 0;
+
+}
+
 /*
  * Check to see if file name lengths would exceed PATHMAX. This means:
  * 1. No possible errors from trying to create a file/dir that exceeds PATHMAX.
@@ -97,21 +186,16 @@ _check_name_lengths(struct ebread init) {
 
 }
 
+/*
+ * The extract directory is named like the output directory, see
+ * _get_output_dir.
+ */
 static int
 _get_unzip_dir(char* uz_dir, struct ebread ebread) {
 
 	char* eb;
 
-	if (ebread.mode == PARSE) {
-
-		strcpy(uz_dir, "/tmp/ebread.XXXXXX");
-
-		if (mkdtemp(uz_dir) == NULL) {
-			fprintf(stderr, "Could not create temporary extract directory\n");
-			return -1;
-		}
-
-	} else if (ebread.mode == UNZIP && ebread.output_dir == NULL) {
+	if (ebread.output_dir == NULL) {
 
 		if (strchr(ebread.epub, '/') != NULL) {
 			eb = strrchr(ebread.epub, '/') + 1;
@@ -129,7 +213,7 @@ _get_unzip_dir(char* uz_dir, struct ebread ebread) {
 			strcat(uz_dir, ".d");
 		}
 
-	} else if (ebread.mode == UNZIP && ebread.output_dir != NULL) {
+	} else {
 
 		strcpy(uz_dir, ebread.output_dir);
 
@@ -234,6 +318,20 @@ ebread_init(int argc, char** argv) {
 		.indent = 4,
 		.stdout = 0,
 		.output_file = NULL,
+		.threads = 1,
+		.crc_rendered = 0,
+		.recover = 0,
+		.include = NULL,
+		.exclude = NULL,
+		.skip_media = 0,
+		.entry_max = 0,
+		.total_max = 0,
+		.ratio_max = 0,
+		.json = 0,
+		.repack_file = NULL,
+		.level = 9,
+		.drop_unreferenced = 0,
+		.store = NULL,
 	};
 
 	struct option opts[] = {
@@ -243,7 +341,23 @@ ebread_init(int argc, char** argv) {
 		{ "stdout", no_argument, 0, 'o' },
 		{ "output-directory", required_argument, 0, 'd' },
 		{ "name", required_argument, 0, 'n' },
+		{ "crc-rendered", no_argument, 0, 'c' },
+		{ "recover", no_argument, 0, 'r' },
 		{ "extract", no_argument, 0, 'x' },
+		{ "list", no_argument, 0, 'L' },
+		{ "json", no_argument, 0, 'j' },
+		{ "test", no_argument, 0, 'k' },
+		{ "threads", required_argument, 0, 't' },
+		{ "include", required_argument, 0, 'I' },
+		{ "exclude", required_argument, 0, 'E' },
+		{ "skip-media", no_argument, 0, 'm' },
+		{ "store", required_argument, 0, 's' },
+		{ "max-entry-size", required_argument, 0, 'S' },
+		{ "max-size", required_argument, 0, 'T' },
+		{ "max-ratio", required_argument, 0, 'R' },
+		{ "repack", required_argument, 0, 'P' },
+		{ "level", required_argument, 0, 'z' },
+		{ "drop-unreferenced", no_argument, 0, 'D' },
 		{ "quiet", no_argument, 0, 'q' },
 		{ "help", no_argument, 0, 'h' },
 		{ "usage", no_argument, 0, 'u' },
@@ -251,7 +365,7 @@ ebread_init(int argc, char** argv) {
 		{ 0, 0, 0, 0 }
 	};
 
-	while ((c = getopt_long(argc, argv, "1:i:l:od:n:xqhuv", opts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "1:i:l:od:n:crxLjkt:I:E:ms:S:T:R:P:z:Dqhuv", opts, NULL)) != -1) {
 		switch (c) {
 		case '1':
 			ebread.output_file = optarg;
@@ -271,9 +385,75 @@ ebread_init(int argc, char** argv) {
 		case 'n':
 			ebread.output_name = optarg;
 			break;
+		case 'c':
+			ebread.crc_rendered = 1;
+			break;
+		case 'r':
+			ebread.recover = 1;
+			break;
 		case 'x':
 			ebread.mode = UNZIP;
 			break;
+		case 'L':
+			ebread.mode = LIST;
+			break;
+		case 'j':
+			ebread.json = 1;
+			break;
+		case 'k':
+			ebread.mode = TEST;
+			break;
+		case 't':
+			ebread.threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'I':
+			if (_add_glob(&ebread.include, argc, optarg) == -1) {
+				ebread.run_state = ERROR;
+				return ebread;
+			}
+			break;
+		case 'E':
+			if (_add_glob(&ebread.exclude, argc, optarg) == -1) {
+				ebread.run_state = ERROR;
+				return ebread;
+			}
+			break;
+		case 'm':
+			ebread.skip_media = 1;
+			break;
+		case 's':
+			ebread.store = optarg;
+			break;
+		case 'S':
+			if (_parse_size(optarg, &ebread.entry_max) == -1) {
+				ebread.run_state = ERROR;
+				return ebread;
+			}
+			break;
+		case 'T':
+			if (_parse_size(optarg, &ebread.total_max) == -1) {
+				ebread.run_state = ERROR;
+				return ebread;
+			}
+			break;
+		case 'R':
+			ebread.ratio_max = strtoul(optarg, NULL, 10);
+			break;
+		case 'P':
+			ebread.mode = REPACK;
+			ebread.repack_file = optarg;
+			break;
+		case 'z':
+			ebread.level = strtoul(optarg, NULL, 10);
+			if (ebread.level > 9) {
+				fprintf(stderr, "Compression level must be 0 to 9\n");
+				ebread.run_state = ERROR;
+				return ebread;
+			}
+			break;
+		case 'D':
+			ebread.drop_unreferenced = 1;
+			break;
 		case 'q':
 			ebread.verbose = 0;
 			break;
@@ -301,6 +481,11 @@ ebread_init(int argc, char** argv) {
 
 	if (optind < argc) {
 		ebread.epub = argv[optind];
+		/* Unpacked epubs are named after their directory, not "" */
+		for (size_t len = strlen(ebread.epub);
+			len > 1 && ebread.epub[len - 1] == '/'; len--) {
+			ebread.epub[len - 1] = '\0';
+		}
 	} else {
 		_print_help();
 		ebread.run_state = ERROR;
@@ -314,6 +499,14 @@ ebread_init(int argc, char** argv) {
 	if (ebread.indent == ULONG_MAX) {
 		ebread.indent = 0;
 	}
+	if (ebread.threads == 0) {
+		ebread.threads = 1;
+	} else if (ebread.threads > MAX_THREADS) {
+		ebread.threads = MAX_THREADS;
+	}
+	if (ebread.ratio_max == ULONG_MAX) {
+		ebread.ratio_max = 0;
+	}
 
 	/*
 	 * 2 is the minimum line length because each line must have room for at
@@ -340,6 +533,15 @@ ebread_init(int argc, char** argv) {
 		}
 	}
 
+	/* There is no file name to name the output after */
+	if (strcmp(ebread.epub, "-") == 0 && ebread.output_dir == NULL
+		&& (ebread.mode == UNZIP || (ebread.mode == PARSE
+		&& ebread.output_file == NULL && !ebread.stdout))) {
+		fprintf(stderr, "Reading from stdin needs -d, -1 or -o\n");
+		ebread.run_state = ERROR;
+		return ebread;
+	}
+
 	if (_check_name_lengths(ebread) == -1) {
 		fprintf(stderr, "Output file name would be too long\n");
 		ebread.run_state = ERROR;
@@ -350,34 +552,440 @@ ebread_init(int argc, char** argv) {
 
 }
 
+/* Flags the epub is opened with, see uz_open_epub */
+static int
+_uz_flags(struct ebread init) {
+
+	return (init.crc_rendered ? UZ_CHECK_RENDERED : 0)
+		| (init.recover ? UZ_RECOVER : 0);
+
+}
+
+/* Extract the epub's contents to disk, no parsing is done. */
+static int
+_run_unzip(struct ebread init) {
+
+	char uz_dir[PATHMAX + 1];
+	struct uz_filter filter = {
+		.include = init.include,
+		.exclude = init.exclude,
+		.skip_media = init.skip_media,
+	};
+	struct uz_budget budget = {
+		.entry_max = init.entry_max,
+		.total_max = init.total_max,
+		.ratio_max = init.ratio_max,
+	};
+
+	if (_get_unzip_dir(uz_dir, init) == -1) {
+		return 1;
+	}
+
+	if (uz_unzip_epub(init.epub, uz_dir, &filter, &budget, init.store,
+		init.threads, _uz_flags(init)) == -1) {
+		fprintf(stderr, "Error extracting %s\n", init.epub);
+		return 1;
+	}
+
+	return 0;
+
+}
+
+/* Inflates every entry to check it, nothing is written. */
+static int
+_run_test(struct ebread init) {
+
+	struct uz_budget budget = {
+		.entry_max = init.entry_max,
+		.total_max = init.total_max,
+		.ratio_max = init.ratio_max,
+	};
+
+	if (uz_test_epub(init.epub, &budget, init.threads, _uz_flags(init))
+		== -1) {
+		fprintf(stderr, "Errors found in %s\n", init.epub);
+		return 1;
+	}
+
+	if (init.verbose) {
+		printf("No errors found in %s\n", init.epub);
+	}
+
+	return 0;
+
+}
+
+/*
+ * Writes the epub back out recompressed, leaving out what its manifest does
+ * not reference if asked to. No parsing is done.
+ */
+static int
+_run_repack(struct ebread init) {
+
+	char rootfile[ZIP_PATH_MAX + 1] = { 0 };
+	struct uz_epub* epub;
+	struct stat st;
+	struct uz_budget budget = {
+		.entry_max = init.entry_max,
+		.total_max = init.total_max,
+		.ratio_max = init.ratio_max,
+	};
+	char* keep = NULL;
+	int index, rtrn = 0;
+
+	if (strcmp(init.epub, "-") == 0) {
+		epub = uz_open_stream(STDIN_FILENO, init.threads, _uz_flags(init));
+	} else if (stat(init.epub, &st) == 0 && S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "%s: Already unpacked\n", init.epub);
+		return 1;
+	} else {
+		epub = uz_open_epub(init.epub, init.threads, _uz_flags(init));
+	}
+
+	if (epub == NULL) {
+		fprintf(stderr, "Error opening %s\n", init.epub);
+		return 1;
+	}
+
+	uz_set_budget(epub, &budget);
+
+	/* Entries are written in the order they came in, a stream's all of them */
+	if (strcmp(init.epub, "-") == 0) {
+		while ((rtrn = uz_next_entry(epub, &index)) == 1) {
+			continue;
+		}
+	}
+
+	if (rtrn != -1 && init.drop_unreferenced
+		&& (epub_get_rootfile(rootfile, epub) == -1
+		|| (keep = epub_get_referenced(epub, rootfile)) == NULL)) {
+		rtrn = -1;
+	}
+
+	if (rtrn != -1) {
+		rtrn = uz_repack_epub(epub, init.repack_file, keep, init.level,
+			init.threads);
+	}
+
+	free(keep);
+
+	uz_close_epub(epub);
+
+	if (rtrn == -1) {
+		fprintf(stderr, "Error repacking %s\n", init.epub);
+		return 1;
+	}
+
+	return 0;
+
+}
+
+/* Prints str as a JSON string, escaping what JSON does not take as is. */
+static void
+_print_json_string(char* str) {
+
+	putchar('"');
+
+	for (unsigned char* p = (unsigned char*) str; *p != '\0'; p++) {
+		if (*p == '"' || *p == '\\') {
+			printf("\\%c", *p);
+		} else if (*p < 0x20) {
+			printf("\\u%04x", *p);
+		} else {
+			putchar(*p);
+		}
+	}
+
+	putchar('"');
+
+}
+
+static void
+_print_info(struct ebread init, struct uz_info* info, int first) {
+
+	char method[16];
+
+	switch (info->method) {
+	case 0:
+		strcpy(method, "stored");
+		break;
+	case 8:
+		strcpy(method, "deflate");
+		break;
+	default:
+		sprintf(method, "%d", info->method);
+		break;
+	}
+
+	if (!init.json) {
+		printf("%10zu %10zu  %-7s  %08lx %10zu  %s\n", info->uncomp_size,
+			info->comp_size, method, info->crc32, info->offset, info->name);
+		return;
+	}
+
+	printf("%s\n  { \"name\": ", first ? "" : ",");
+	_print_json_string(info->name);
+	printf(", \"size\": %zu, \"compressed\": %zu, \"method\": \"%s\", "
+		"\"crc32\": \"%08lx\", \"offset\": %zu }", info->uncomp_size,
+		info->comp_size, method, info->crc32, info->offset);
+
+}
+
+/*
+ * Lists the epub's entries without inflating anything. An archive's come out
+ * of its central directory alone, a stream's out of their local headers.
+ */
+static int
+_run_list(struct ebread init) {
+
+	struct uz_epub* epub;
+	struct uz_info info;
+	struct uz_memory mem;
+	struct stat st;
+	int index, rtrn = 0;
+
+	if (strcmp(init.epub, "-") == 0) {
+		epub = uz_open_stream(STDIN_FILENO, init.threads, 0);
+	} else if (stat(init.epub, &st) == 0 && S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "%s: Already unpacked\n", init.epub);
+		return 1;
+	} else {
+		epub = uz_open_epub(init.epub, init.threads,
+			init.recover ? UZ_RECOVER : 0);
+	}
+
+	if (epub == NULL) {
+		fprintf(stderr, "Error opening %s\n", init.epub);
+		return 1;
+	}
+
+	if (init.json) {
+		printf("[");
+	} else if (init.verbose) {
+		printf("    Length       Size  Method     CRC-32     Offset  Name\n");
+	}
+
+	if (strcmp(init.epub, "-") == 0) {
+		while ((rtrn = uz_next_entry(epub, &index)) == 1) {
+			uz_entry_info(epub, index, &info);
+			_print_info(init, &info, index == 0);
+			uz_drop_entry(epub, index);
+		}
+	} else {
+		for (index = 0; index < uz_entry_count(epub); index++) {
+			if (uz_entry_info(epub, index, &info) == -1) {
+				fprintf(stderr, "Could not read archive entry %d\n", index);
+				rtrn = -1;
+				break;
+			}
+			_print_info(init, &info, index == 0);
+		}
+	}
+
+	if (init.json) {
+		printf("\n]\n");
+	}
+
+	/* Streams have no central directory to report on */
+	uz_memory_use(epub, &mem);
+
+	if (!init.json && init.verbose && rtrn != -1 && mem.reserved > 0) {
+		printf("Central directory: %zu bytes in use, %zu at most, %zu "
+			"reserved\n", mem.used, mem.peak, mem.reserved);
+	}
+
+	uz_close_epub(epub);
+
+	if (rtrn == -1) {
+		fprintf(stderr, "Error listing %s\n", init.epub);
+		return 1;
+	}
+
+	return 0;
+
+}
+
+/*
+ * Renders spine item i to its output file. Items the archive does not have
+ * are skipped.
+ */
+static void
+_render_item(struct ebread init, struct uz_epub* epub, struct spine spine,
+             int i, char* out_dir, char* cur_out) {
+
+	if (spine.entries[i] == -1) {
+		if (spine.hrefs[i] != NULL) {
+			fprintf(stderr, "%s: No such entry in archive\n", spine.hrefs[i]);
+		}
+		return;
+	}
+
+	if (init.output_file == NULL && !init.stdout) {
+		memset(cur_out, 0, PATHMAX + 1);
+		_get_output_file(init, cur_out, out_dir, spine.hrefs[i]);
+	}
+
+	if (init.verbose) {
+		printf("Parsing %s, writing output to %s\n", spine.hrefs[i], cur_out);
+	}
+
+	epub_html2text(epub, spine.entries[i], cur_out, init.linelen, init.indent);
+
+}
+
+/*
+ * Whether entry index is still needed by spine items from next on. Before the
+ * spine is known, any entry could be.
+ */
+static int
+_is_pending(struct spine spine, int next, int index) {
+
+	if (spine.hrefs == NULL) {
+		return 1;
+	}
+
+	for (int i = next; i < spine.hrefnum; i++) {
+		if (spine.entries[i] == index) {
+			return 1;
+		}
+	}
+
+	return 0;
+
+}
+
+/*
+ * Renders an epub being read off stdin as its entries come in. The root file
+ * is looked for as soon as the container is in, and each spine item is
+ * rendered as soon as it and every item before it are in. Entries are dropped
+ * once nothing needs them, so only chapters that come in ahead of the root
+ * file, or ahead of chapters before them, are ever held on to.
+ */
+static int
+_run_stream(struct ebread init, struct uz_epub* epub, char* out_dir,
+            char* cur_out) {
+
+	char rootfile[ZIP_PATH_MAX + 1] = { 0 };
+	struct spine spine = { .hrefs = NULL, .entries = NULL, .hrefnum = 0 };
+	int index, next = 0, rtrn;
+
+	while ((rtrn = uz_next_entry(epub, &index)) == 1) {
+
+		if (*rootfile == '\0') {
+
+			if (uz_locate_entry(epub, EPUB_CONTAINER_PATH) != index) {
+				continue;
+			}
+
+			if (epub_get_rootfile(rootfile, epub) == -1) {
+				fprintf(stderr, "Could not find rootfile in %s\n", init.epub);
+				return 1;
+			}
+
+		}
+
+		if (spine.hrefs == NULL) {
+
+			/* The root file may well have come in ahead of the container */
+			if (uz_locate_entry(epub, rootfile) == -1) {
+				continue;
+			}
+
+			spine = epub_get_spine(epub, rootfile);
+
+			if (spine.hrefs == NULL) {
+				fprintf(stderr, "Could not parse rootfile in %s\n", init.epub);
+				return 1;
+			}
+
+			for (int i = 0; i < index; i++) {
+				if (!_is_pending(spine, 0, i)) {
+					uz_drop_entry(epub, i);
+				}
+			}
+
+		} else {
+
+			for (int i = next; i < spine.hrefnum; i++) {
+				if (spine.entries[i] == -1 && spine.hrefs[i] != NULL
+					&& epub_locate_href(epub, spine.hrefs[i]) == index) {
+					spine.entries[i] = index;
+				}
+			}
+
+		}
+
+		for (; next < spine.hrefnum && spine.entries[next] != -1; next++) {
+			_render_item(init, epub, spine, next, out_dir, cur_out);
+			if (!_is_pending(spine, next + 1, spine.entries[next])) {
+				uz_drop_entry(epub, spine.entries[next]);
+			}
+		}
+
+		if (!_is_pending(spine, next, index)) {
+			uz_drop_entry(epub, index);
+		}
+
+	}
+
+	if (rtrn == -1) {
+		fprintf(stderr, "Error reading %s\n", init.epub);
+	} else if (*rootfile == '\0') {
+		fprintf(stderr, "Could not find rootfile in %s\n", init.epub);
+		rtrn = -1;
+	} else if (spine.hrefs == NULL) {
+		fprintf(stderr, "Could not parse rootfile in %s\n", init.epub);
+		rtrn = -1;
+	}
+
+	/* Items after one the archive does not have waited for the end */
+	for (; rtrn != -1 && next < spine.hrefnum; next++) {
+		_render_item(init, epub, spine, next, out_dir, cur_out);
+	}
+
+	if (spine.hrefs != NULL) {
+		epub_free_spine(spine);
+	}
+
+	return rtrn == -1 ? 1 : 0;
+
+}
+
 int
 ebread_run(struct ebread init) {
 
-	char uz_dir[PATHMAX + 1];
 	char out_dir[PATHMAX + 1];
-	char rootfile[ZIP_PATH_MAX + TMPDIRLEN + 1] = { 0 };
+	char rootfile[ZIP_PATH_MAX + 1] = { 0 };
+	struct uz_epub* epub;
 	struct spine spine;
-	char content_dir[ZIP_PATH_MAX + 1];
-	char cur_file[PATHMAX + 1];
 	char cur_out[PATHMAX + 1];
+	int flags = _uz_flags(init);
+	struct uz_budget budget = {
+		.entry_max = init.entry_max,
+		.total_max = init.total_max,
+		.ratio_max = init.ratio_max,
+	};
+	int rtrn;
 
-	if (access(init.epub, R_OK) == -1) {
+	if (strcmp(init.epub, "-") != 0 && access(init.epub, R_OK) == -1) {
 		fprintf(stderr, "Could not open %s\n", init.epub);
 		return 1;
 	}
 
-	if (_get_unzip_dir(uz_dir, init) == -1) {
-		return 1;
+	if (init.mode == UNZIP) {
+		return _run_unzip(init);
 	}
 
-	if (uz_unzip_epub(init.epub, uz_dir) == -1) {
-		fprintf(stderr, "Error extracting %s\n", init.epub);
-		return 1;
+	if (init.mode == LIST) {
+		return _run_list(init);
 	}
 
-	/* Nothing else to be done in UNZIP mode :-) */
-	if (init.mode == UNZIP) {
-		return 0;
+	if (init.mode == TEST) {
+		return _run_test(init);
+	}
+
+	if (init.mode == REPACK) {
+		return _run_repack(init);
 	}
 
 	if (init.stdout) {
@@ -407,60 +1015,57 @@ ebread_run(struct ebread init) {
 		}
 	}
 
-	if (epub_get_rootfile(rootfile, uz_dir) == -1) {
+	/*
+	 * Entries are inflated straight into memory, nothing besides the output
+	 * ever touches the filesystem.
+	 */
+	if (strcmp(init.epub, "-") == 0) {
+		epub = uz_open_stream(STDIN_FILENO, init.threads, flags);
+	} else {
+		epub = uz_open_epub(init.epub, init.threads, flags);
+	}
+
+	if (epub == NULL) {
+		fprintf(stderr, "Error opening %s\n", init.epub);
+		return 1;
+	}
+
+	uz_set_budget(epub, &budget);
+
+	if (strcmp(init.epub, "-") == 0) {
+		rtrn = _run_stream(init, epub, out_dir, cur_out);
+		uz_close_epub(epub);
+		return rtrn;
+	}
+
+	if (epub_get_rootfile(rootfile, epub) == -1) {
 		fprintf(stderr, "Could not find rootfile in %s\n", init.epub);
+		uz_close_epub(epub);
 		return 1;
 	}
 
-	spine = epub_get_spine(rootfile);
+	spine = epub_get_spine(epub, rootfile);
 
 	if (spine.hrefs == NULL) {
 		fprintf(stderr, "Could not parse rootfile in %s\n", init.epub);
+		uz_close_epub(epub);
 		return 1;
 	}
 
-/*
- * The content directory is the directory where all the html pages are stored.
- * The rootfile is also in the content directory, so we'll use it to copy it
- * over to cont_dir.
- */
-	if (strchr(rootfile, '/') != NULL) {
-		*(strrchr(rootfile, '/')) = '\0';
-		strcpy(content_dir, rootfile);
-		*(strchr(rootfile, '\0')) = '/';
-	} else {
-		strcpy(content_dir, uz_dir);
-	}
+	/*
+	 * Chapters are read in the order they lie in the archive, ahead of being
+	 * rendered in the order of the spine.
+	 */
+	uz_prefetch(epub, spine.entries, spine.hrefnum);
 
 	for (int i = 0; i < spine.hrefnum; i++) {
-
-		memset(cur_file, 0, sizeof(cur_file));
-		sprintf(cur_file, "%s/%s", content_dir, spine.hrefs[i]);
-
-		if (init.output_file == NULL && !init.stdout) {
-			memset(cur_out, 0, sizeof(cur_out));
-			_get_output_file(init, cur_out, out_dir, spine.hrefs[i]);
-		}
-
-		if (init.verbose) {
-			printf("Parsing %s, writing output to %s\n", cur_file, cur_out);
-		}
-
-		epub_html2text(cur_file, cur_out, init.linelen, init.indent);
-
+		_render_item(init, epub, spine, i, out_dir, cur_out);
 	}
 
 	epub_free_spine(spine);
 
-/*
- * TODO:
- * Sometimes uz_rm_tree never gets to delete the uz_dir when using the -o
- * option while piping, this is because ebread recieves a SIGPIPE. Is
- * there a way around this?
- */
-	uz_rm_tree(uz_dir);
+	uz_close_epub(epub);
 
 	return 0;
 
 }
-
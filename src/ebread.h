@@ -3,7 +3,7 @@ typedef int flag_t;
 struct ebread {
 	char* epub;
 	enum { RUN, NORUN, ERROR } run_state;
-	enum { PARSE, UNZIP } mode;
+	enum { PARSE, UNZIP, LIST, TEST, REPACK } mode;
 	char* output_dir;
 	char* output_name;
 	flag_t verbose;
@@ -11,6 +11,25 @@ struct ebread {
 	unsigned long indent;
 	int stdout;
 	char* output_file;
+	unsigned long threads;
+	flag_t crc_rendered;
+	flag_t recover;
+	/* NULL-terminated globs given with -I and -E, NULL if none were */
+	char** include;
+	char** exclude;
+	flag_t skip_media;
+	/* Caps on what the epub may inflate to, 0 for none, see uz_budget */
+	unsigned long entry_max;
+	unsigned long total_max;
+	unsigned long ratio_max;
+	/* List entries as JSON instead of columns */
+	flag_t json;
+	/* Where -P writes the repacked epub, at level, see uz_repack_epub */
+	char* repack_file;
+	unsigned long level;
+	flag_t drop_unreferenced;
+	/* Directory -x shares files through across books, NULL for none */
+	char* store;
 };
 
 struct ebread ebread_init(int argc, char** argv);
@@ -1,15 +1,13 @@
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "epub.h"
+#include "unzip.h"
 #include "xml.h"
 
-#define PATHMAX 4096
-
-/* The epub standard states that the root file's path must be here. */
-static char* container_path = "META-INF/container.xml";
-
 static char* text_nodes[] = {
 	"p",
 	"h1",
@@ -26,20 +24,150 @@ static char* text_nodes[] = {
 	NULL,
 };
 
-static struct xml_tree_node*
-_get_text_parent(struct xml_tree_node* node) {
+/* State of the line wrapper while an html file streams through it. */
+struct text_output {
+	FILE* outputf;
+	char* curline;
+	int linelen;
+	int indent;
+	/* id of the text parent of the last text written, 0 if none */
+	unsigned long prev_txtp;
+};
 
-	struct xml_tree_node* cur = node;
+/* Returns the id of the innermost open text node, 0 if there is none. */
+static unsigned long
+_get_text_parent(struct xml_stream* stream) {
 
-	do {
+	for (int i = stream->nodenum - 1; i >= 0; i--) {
 		for (char** p = text_nodes; *p != NULL; p++) {
-			if (xml_strcmpnul(cur->name, *p) == 0) {
-				return cur;
+			if (strcmp(stream->nodes[i].name, *p) == 0) {
+				return stream->nodes[i].id;
 			}
 		}
-	} while ((cur = cur->parent) != NULL);
+	}
+
+	return 0;
+
+}
+
+/*
+ * Reads entry name out of epub and builds its xml node tree. Entries that were
+ * mapped rather than read are not owned by the tree, size and mapped are
+ * needed again to free it with _free_entry_tree.
+ */
+static struct xml_tree_node*
+_build_entry_tree(struct uz_epub* epub, char* name, size_t* size, int* mapped) {
+
+	char* content;
+	struct xml_tree_node* tree;
+
+	int index;
+
+	if ((index = uz_locate_entry(epub, name)) == -1) {
+		fprintf(stderr, "%s: No such entry in archive\n", name);
+		return NULL;
+	}
+
+	if ((content = uz_read_entry(epub, index, size, mapped)) == NULL) {
+		fprintf(stderr, "%s: Could not parse\n", name);
+		return NULL;
+	}
+
+	if ((tree = xml_build_tree(content, *size, !*mapped)) == NULL && *mapped) {
+		uz_unmap_entry(content, *size);
+	}
+
+	return tree;
+
+}
+
+static void
+_free_entry_tree(struct xml_tree_node* tree, size_t size, int mapped) {
+
+	char* content = tree->content_ptr;
+
+	xml_free_tree(tree);
+
+	if (mapped) {
+		uz_unmap_entry(content, size);
+	}
+
+}
+
+/*
+ * hrefs in the root file are relative to the root file's directory. Returns
+ * href's full archive path in a new heap buffer.
+ */
+static char*
+_resolve_href(char* rootfile, char* href) {
+
+	char* path;
+	size_t dirlen = 0;
+
+	if (strchr(rootfile, '/') != NULL) {
+		dirlen = strrchr(rootfile, '/') - rootfile + 1;
+	}
+
+	if ((path = malloc(dirlen + strlen(href) + 1)) == NULL) {
+		return NULL;
+	}
+
+	memcpy(path, rootfile, dirlen);
+	strcpy(path + dirlen, href);
+
+	uz_clean_path(path);
 
-	return NULL;
+	return path;
+
+}
+
+/*
+ * Decodes the %XX escapes a manifest href may have, in place, for entries
+ * named with characters hrefs cannot hold as they are.
+ */
+static void
+_unescape_href(char* href) {
+
+	char* src = href;
+	char* dst = href;
+	unsigned int c;
+
+	for (; *src != '\0'; src++, dst++) {
+		if (src[0] == '%' && isxdigit((unsigned char) src[1])
+			&& isxdigit((unsigned char) src[2])
+			&& sscanf(src + 1, "%2x", &c) == 1) {
+			*dst = c;
+			src += 2;
+		} else {
+			*dst = *src;
+		}
+	}
+
+	*dst = '\0';
+
+}
+
+int
+epub_locate_href(struct uz_epub* epub, char* path) {
+
+	char* decoded;
+	int index;
+
+	if ((index = uz_locate_entry(epub, path)) != -1
+		|| strchr(path, '%') == NULL || (decoded = strdup(path)) == NULL) {
+		return index;
+	}
+
+	_unescape_href(decoded);
+
+	/* Decoding never makes the path any longer */
+	if ((index = uz_locate_entry(epub, decoded)) != -1) {
+		strcpy(path, decoded);
+	}
+
+	free(decoded);
+
+	return index;
 
 }
 
@@ -56,17 +184,57 @@ _add_indent(char* line, int indent) {
 
 }
 
+/*
+ * Looks for a root file among the entries themselves, for archives that lost
+ * their container, such as ones cut short and recovered by uz_open_epub.
+ */
+static int
+_find_rootfile(char* rootfile, struct uz_epub* epub) {
+
+	struct uz_info info;
+	size_t len;
+
+	for (int i = 0; i < uz_entry_count(epub); i++) {
+
+		if (uz_entry_info(epub, i, &info) == -1) {
+			continue;
+		}
+
+		len = strlen(info.name);
+
+		if (len > 4 && strcasecmp(info.name + len - 4, ".opf") == 0
+			&& len <= ZIP_PATH_MAX) {
+			fprintf(stderr, "No container file, using %s as root file\n",
+				info.name);
+			strcpy(rootfile, info.name);
+			uz_clean_path(rootfile);
+			return 0;
+		}
+
+	}
+
+	fprintf(stderr, "Could not find container file\n");
+
+	return -1;
+
+}
+
 int
-epub_get_rootfile(char* rootfile, char* rootdir) {
+epub_get_rootfile(char* rootfile, struct uz_epub* epub) {
 
 	struct xml_tree_node* head;
 	struct xml_tree_node* cur;
-	char container[PATHMAX];
 	char* rf_fullpath;
+	size_t size;
+	int mapped;
+
+	if (uz_locate_entry(epub, EPUB_CONTAINER_PATH) == -1) {
+		return _find_rootfile(rootfile, epub);
+	}
 
-	sprintf(container, "%s/%s", rootdir, container_path);
+	head = _build_entry_tree(epub, EPUB_CONTAINER_PATH, &size, &mapped);
 
-	if ((head = xml_build_tree(container)) == NULL) {
+	if (head == NULL) {
 		fprintf(stderr, "Could not parse container file\n");
 		return -1;
 	}
@@ -81,38 +249,42 @@ epub_get_rootfile(char* rootfile, char* rootdir) {
 	}
 
 	if (cur == NULL) {
-		xml_free_tree(head);
+		_free_entry_tree(head, size, mapped);
 		return -1;
 	}
 
 	cur = cur->child;
 
 	if ((rf_fullpath = xml_get_prop(cur, "full-path")) == NULL) {
-		xml_free_tree(head);
+		_free_entry_tree(head, size, mapped);
 		return -1;
 	}
 
-	strcat(rootfile, rootdir);
 	strncat(rootfile, rf_fullpath, strcspn(rf_fullpath, "\""));
+	uz_clean_path(rootfile);
 
-	xml_free_tree(head);
+	_free_entry_tree(head, size, mapped);
 
 	return 0;
 
 }
 
 struct spine
-epub_get_spine(char* rootfile) {
+epub_get_spine(struct uz_epub* epub, char* rootfile) {
 
 	struct spine spine;
 	struct xml_tree_node* head;
 	struct xml_tree_node* cur;
 	struct xml_tree_node* spinen = NULL;
 	struct xml_tree_node* manifn = NULL;
+	size_t size;
+	int mapped;
 
 	spine.hrefnum = 0;
+	spine.hrefs = NULL;
+	spine.entries = NULL;
 
-	if ((head = xml_build_tree(rootfile)) == NULL) {
+	if ((head = _build_entry_tree(epub, rootfile, &size, &mapped)) == NULL) {
 		fprintf(stderr, "Could not parse rootfile\n");
 		spine.hrefs = NULL;
 		return spine;
@@ -144,13 +316,13 @@ epub_get_spine(char* rootfile) {
 
 	if (spinen == NULL) {
 		fprintf(stderr, "EPUB's root file does not contain a spine\n");
-		xml_free_tree(head);
+		_free_entry_tree(head, size, mapped);
 		return spine;
 	}
 
 	if (manifn == NULL) {
 		fprintf(stderr, "EPUB's root file does not contain a manifest\n");
-		xml_free_tree(head);
+		_free_entry_tree(head, size, mapped);
 		return spine;
 	}
 
@@ -164,13 +336,19 @@ epub_get_spine(char* rootfile) {
 
 	if (spine.hrefnum == 0) {
 		fprintf(stderr, "Found no items in root file's spine\n");
-		xml_free_tree(head);
+		_free_entry_tree(head, size, mapped);
 		return spine;
 	}
 
-	if ((spine.hrefs = malloc(sizeof(char*) * spine.hrefnum)) == NULL) {
+	spine.hrefs = calloc(spine.hrefnum, sizeof(char*));
+	spine.entries = malloc(sizeof(int) * spine.hrefnum);
+
+	if (spine.hrefs == NULL || spine.entries == NULL) {
 		fprintf(stderr, "Could not allocate memory\n");
-		xml_free_tree(head);
+		free(spine.hrefs);
+		free(spine.entries);
+		spine.hrefs = NULL;
+		_free_entry_tree(head, size, mapped);
 		return spine;
 	}
 
@@ -205,18 +383,15 @@ epub_get_spine(char* rootfile) {
 
 			href = xml_get_prop(curmanif, "href");
 
-			if ((spine.hrefs[i] = strdup(href)) == NULL) {
+			if ((spine.hrefs[i] = _resolve_href(rootfile, href)) == NULL) {
 				fprintf(stderr, "Could not allocate memory\n");
-				for (int j = 0; j < i; j++) {
-					free(spine.hrefs[j]);
-				}
-				free(spine.hrefs);
-				xml_free_tree(head);
+				epub_free_spine(spine);
+				_free_entry_tree(head, size, mapped);
 				spine.hrefs = NULL;
 				return spine;
 			}
 
-			curmanif = curmanif->next;
+			break;
 
 		}
 
@@ -224,7 +399,20 @@ epub_get_spine(char* rootfile) {
 
 	}
 
-	xml_free_tree(head);
+	_free_entry_tree(head, size, mapped);
+
+	/*
+	 * Everything the spine needs is looked up in the central directory before
+	 * anything gets inflated.
+	 */
+	for (int i = 0; i < spine.hrefnum; i++) {
+		spine.entries[i] = -1;
+		if (spine.hrefs[i] == NULL) {
+			fprintf(stderr, "Spine item %d has no manifest item\n", i + 1);
+		} else {
+			spine.entries[i] = epub_locate_href(epub, spine.hrefs[i]);
+		}
+	}
 
 	return spine;
 
@@ -237,98 +425,214 @@ epub_free_spine(struct spine spine) {
 		free(spine.hrefs[i]);
 	}
 	free(spine.hrefs);
+	free(spine.entries);
 
 }
 
-int
-epub_html2text(char* html, char* output, int linelen, int indent) {
+/* Marks the entry href points to in keep, if the archive has it */
+static int
+_mark_href(struct uz_epub* epub, char* rootfile, char* href, char* keep) {
 
-	FILE* outputf;
-	struct xml_tree_node* tree;
-	struct xml_tree_node* cur;
-	struct xml_tree_node *cur_txtp, *prev_txtp;
-	char* curline;
+	char* path;
+	int index;
 
-	outputf = fopen(output, "a");
-
-	if ((curline = calloc(linelen + 2, sizeof(char))) == NULL) {
+	if ((path = _resolve_href(rootfile, href)) == NULL) {
 		fprintf(stderr, "Could not allocate memory\n");
 		return -1;
 	}
 
-	_add_indent(curline, indent);
+	if ((index = epub_locate_href(epub, path)) != -1) {
+		keep[index] = 1;
+	}
 
-	tree = xml_build_tree(html);
+	free(path);
 
-	cur = tree;
+	return 0;
 
-	prev_txtp = NULL;
+}
 
-	do {
+char*
+epub_get_referenced(struct uz_epub* epub, char* rootfile) {
 
-		char* p;
-		size_t wordlen = 0;
+	struct xml_tree_node* head;
+	struct xml_tree_node* cur;
+	struct uz_info info;
+	char* keep;
+	char* href;
+	size_t size;
+	int mapped;
 
-		if (xml_strcmpnul(cur->name, "br") == 0) {
-			fprintf(outputf, "%s\n", curline);
-			memset(curline, 0, linelen + 2);
-			_add_indent(curline, indent);
-			continue;
+	if ((keep = calloc(uz_entry_count(epub) + 1, 1)) == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		return NULL;
+	}
+
+	if ((head = _build_entry_tree(epub, rootfile, &size, &mapped)) == NULL) {
+		fprintf(stderr, "Could not parse rootfile\n");
+		free(keep);
+		return NULL;
+	}
+
+	/* Points to package's child node */
+	for (cur = head->child->child; cur != NULL; cur = cur->next) {
+		if (xml_strcmpnul(cur->name, "manifest") == 0) {
+			break;
 		}
+	}
+
+	if (cur == NULL) {
+		fprintf(stderr, "EPUB's root file does not contain a manifest\n");
+		_free_entry_tree(head, size, mapped);
+		free(keep);
+		return NULL;
+	}
+
+	for (cur = cur->child; cur != NULL; cur = cur->next) {
 
-		if ((p = cur->text) == NULL) {
+		if (xml_strcmpnul(cur->name, "item") != 0
+			|| (href = xml_get_prop(cur, "href")) == NULL) {
 			continue;
 		}
 
-		if ((cur_txtp = _get_text_parent(cur)) != prev_txtp) {
-			fprintf(outputf, "%s\n\n", curline);
-			memset(curline, 0, linelen + 2);
-			_add_indent(curline, indent);
-			prev_txtp = cur_txtp;
+		if (_mark_href(epub, rootfile, href, keep) == -1) {
+			_free_entry_tree(head, size, mapped);
+			free(keep);
+			return NULL;
 		}
 
-		while (*(p += strspn(p, " ")) != '\0') {
+	}
 
-			wordlen = strcspn(p, " ");
+	_free_entry_tree(head, size, mapped);
 
-			/* Drop to next line */
-			if (wordlen + strlen(curline) > linelen) {
+	/* Whatever the manifest says, the epub does not open without these */
+	for (int i = 0; i < uz_entry_count(epub); i++) {
+		if (uz_entry_info(epub, i, &info) == 0
+			&& (strcmp(info.name, "mimetype") == 0
+			|| strncmp(info.name, "META-INF/", 9) == 0
+			|| strcmp(info.name, rootfile) == 0)) {
+			keep[i] = 1;
+		}
+	}
 
-				fprintf(outputf, "%s\n", curline);
-				memset(curline, 0, linelen + 2);
-				_add_indent(curline, indent);
+	return keep;
+
+}
 
-				/* Hyphenate words longer than linelen - indent */
-				while (wordlen > linelen - indent) {
+static void
+_new_line(struct text_output* out, char* end) {
 
-					strncat(curline, p, linelen - indent - 1);
-					strcat(curline, "-");
+	fprintf(out->outputf, "%s%s", out->curline, end);
+	memset(out->curline, 0, out->linelen + 2);
+	_add_indent(out->curline, out->indent);
 
-					fprintf(outputf, "%s\n", curline);
+}
 
-					memset(curline, 0, linelen + 2);
+static int
+_html_node(struct xml_stream* stream) {
 
-					p += linelen - indent - 1;
-					wordlen -= linelen  - indent - 1;
+	struct text_output* out = stream->data;
 
-					_add_indent(curline, indent);
-				}
+	if (strcmp(stream->nodes[stream->nodenum - 1].name, "br") == 0) {
+		_new_line(out, "\n");
+	}
 
-			}
+	return 0;
 
-			strncat(curline, p, wordlen);
-			strcat(curline, " ");
+}
+
+static int
+_html_text(struct xml_stream* stream, char* p) {
+
+	struct text_output* out = stream->data;
+	size_t linelen = out->linelen;
+	size_t indent = out->indent;
+	size_t wordlen = 0;
+	unsigned long cur_txtp;
+
+	if ((cur_txtp = _get_text_parent(stream)) != out->prev_txtp) {
+		_new_line(out, "\n\n");
+		out->prev_txtp = cur_txtp;
+	}
+
+	while (*(p += strspn(p, " ")) != '\0') {
+
+		wordlen = strcspn(p, " ");
+
+		/* Drop to next line */
+		if (wordlen + strlen(out->curline) > linelen) {
+
+			_new_line(out, "\n");
+
+			/* Hyphenate words longer than linelen - indent */
+			while (wordlen > linelen - indent) {
+
+				strncat(out->curline, p, linelen - indent - 1);
+				strcat(out->curline, "-");
 
-			p += strcspn(p, " ");
+				_new_line(out, "\n");
+
+				p += linelen - indent - 1;
+				wordlen -= linelen  - indent - 1;
+
+			}
 
 		}
 
-	} while ((cur = cur->traverse) != NULL);
+		strncat(out->curline, p, wordlen);
+		strcat(out->curline, " ");
 
-	free(curline);
-	xml_free_tree(tree);
-	fclose(outputf);
+		p += strcspn(p, " ");
+
+	}
 
 	return 0;
 
 }
+
+static int
+_feed_html(char* buf, size_t len, void* stream) {
+
+	return xml_stream_feed(stream, buf, len);
+
+}
+
+int
+epub_html2text(struct uz_epub* epub, int html, char* output, int linelen,
+               int indent) {
+
+	struct text_output out;
+	struct xml_stream stream;
+	int rtrn;
+
+	if ((out.outputf = fopen(output, "a")) == NULL) {
+		fprintf(stderr, "%s: Could not open\n", output);
+		return -1;
+	}
+
+	if ((out.curline = calloc(linelen + 2, sizeof(char))) == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		fclose(out.outputf);
+		return -1;
+	}
+
+	out.linelen = linelen;
+	out.indent = indent;
+	out.prev_txtp = 0;
+
+	_add_indent(out.curline, indent);
+
+	/* The html is parsed as it is inflated, it is never held in full. */
+	xml_stream_init(&stream, _html_node, _html_text, &out);
+
+	rtrn = uz_stream_entry(epub, html, _feed_html, &stream);
+
+	if (xml_stream_end(&stream) == -1) {
+		rtrn = -1;
+	}
+
+	free(out.curline);
+	fclose(out.outputf);
+
+	return rtrn;
+
+}
@@ -1,3 +1,8 @@
+struct uz_epub;
+
+/* The epub standard states that the root file's path must be here. */
+#define EPUB_CONTAINER_PATH "META-INF/container.xml"
+
 /*
  * The spine is a structure in an epub root file that lists the xhtml content
  * files of the epub using IDs. Each ID has a respective content file listed in
@@ -5,25 +10,52 @@
  * parse.
  */
 struct spine {
+	/* Archive paths of the content files, NULL if an item is not in the
+	 * manifest. */
 	char** hrefs;
+	/* Archive entry of each href, -1 if the archive does not have it. */
+	int* entries;
 	int hrefnum;
 };
 
 /*
- * Get the path to the epub's root file. rootdir is the directory that the epub
- * was unzipped to. If the root file is found, it is written to rootfile.
+ * Get the archive path of the epub's root file. If the root file is found, it
+ * is written to rootfile.
  */
-int epub_get_rootfile(char* rootfile, char* rootdir);
+int epub_get_rootfile(char* rootfile, struct uz_epub* epub);
 
-/* Get spine in rootfile, which we will use to find what xhtml files to parse */
+/*
+ * Get spine in rootfile, which we will use to find what xhtml files to parse.
+ * Each item is resolved against the epub's central directory up front, so
+ * only the entries that are actually needed ever get inflated. Items the
+ * archive does not have, or not yet, are left at -1.
+ */
 /* NOTE: Spine should be freed using epub_free_spine when no longer in use. */
-struct spine epub_get_spine(char* rootfile);
+struct spine epub_get_spine(struct uz_epub* epub, char* rootfile);
 
 /* Free spine created by epub_get_spine */
 void epub_free_spine(struct spine spine);
 
 /*
- * Parse html, write to output. linelen specifies maximum output line length
+ * Looks up the entry path, an href resolved against the root file, points to.
+ * An entry whose name has characters an href cannot hold as they are is found
+ * through the href's %XX escapes, and path is then decoded in place. Returns
+ * the entry's index, or -1 if the archive has no such entry.
+ */
+int epub_locate_href(struct uz_epub* epub, char* path);
+
+/*
+ * Get which entries of epub are referenced by rootfile's manifest, as a flag
+ * per entry. mimetype, the root file itself and everything under META-INF are
+ * always flagged, the epub cannot be opened without them. Returns NULL if the
+ * manifest could not be read.
+ */
+/* NOTE: Should be freed using free when no longer in use. */
+char* epub_get_referenced(struct uz_epub* epub, char* rootfile);
+
+/*
+ * Parse html, the index of an entry in epub, write to output. html is parsed as it is
+ * inflated, so it is never held in memory in full. linelen specifies maximum output line length
  * (including indent spaces) and indent the number of spaces an indent has.
  * There are some things html2text is not capable of doing (as of right now):
  * - Does not read {un}ordered lists properly. html2text just treats each item
@@ -33,4 +65,5 @@ void epub_free_spine(struct spine spine);
  * - Links in <a> tags are ignored.
  * - Anything relating to CSS is ignored.
  */
-int epub_html2text(char* html, char* output, int linelen, int indent);
+int epub_html2text(struct uz_epub* epub, int html, char* output, int linelen,
+                   int indent);
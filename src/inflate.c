@@ -0,0 +1,1586 @@
+/*
+ * Raw deflate decoder, see RFC 1951. Where tinfl decodes a symbol a step and
+ * copies matches a byte at a time, each step here refills a 64-bit bit buffer
+ * once and looks up a whole symbol, or two literals at once, in one table.
+ * Matches are copied a word at a time. Close to the end of the input or of
+ * the output, a careful loop that checks every bit and byte takes over.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "inflate.h"
+
+/*
+ * Worth it where the bit buffer fits in a register and can be refilled with a
+ * single unaligned load.
+ */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ \
+	&& UINTPTR_MAX > 0xFFFFFFFFu
+#define INF_FAST 1
+#else
+#define INF_FAST 0
+#endif
+
+/* The kernel is built a second time for CPUs with BMI2's shifts and masks */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_BMI2_KERNEL
+#endif
+
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+/*
+ * Bits looked up at once in each table. Longer codes continue in a subtable
+ * made for their first bits.
+ */
+#define LITLEN_BITS  11
+#define DIST_BITS    8
+#define CODELEN_BITS 7
+
+/* Main table plus room for a subtable of at most 2^(15 - bits) per symbol */
+#define LITLEN_SIZE  ((1 << LITLEN_BITS) + 288 * (1 << (15 - LITLEN_BITS)))
+#define DIST_SIZE    ((1 << DIST_BITS) + 32 * (1 << (15 - DIST_BITS)))
+
+/*
+ * The fast loop needs room for the longest match, plus what a wide copy may
+ * write past its end.
+ */
+#define FAST_ROOM (258 + 16)
+
+/*
+ * Table entries hold the number of bits the code takes up, what the code is,
+ * a number of extra bits and a value. Literals have the literal as value, a
+ * pair of literals has the first in the value's low byte and the second in
+ * its high byte, with the first code's bits as extra. Lengths and distances
+ * have their base as value. Subtables have their offset as value and their
+ * size in bits as extra.
+ */
+#define ENT_BITS(e)  ((e) & 0x1F)
+#define ENT_KIND(e)  (((e) >> 5) & 0x7)
+#define ENT_EXTRA(e) (((e) >> 8) & 0x1F)
+#define ENT_VALUE(e) ((e) >> 16)
+#define ENTRY(kind, extra, value) \
+	((uint32_t) (value) << 16 | (uint32_t) (extra) << 8 | (kind) << 5)
+
+enum { K_LIT, K_LIT2, K_LEN, K_DIST, K_EOB, K_SUB, K_BAD };
+
+enum { T_LITLEN, T_DIST, T_CODELEN };
+
+enum { S_HEADER, S_STORED, S_HUFFMAN, S_DONE };
+
+static const uint16_t len_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+	67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const uint8_t len_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4,
+	5, 5, 5, 5, 0
+};
+
+static const uint16_t dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513,
+	769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+static const uint8_t dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10,
+	11, 11, 12, 12, 13, 13
+};
+
+/* Order the code length code lengths are stored in */
+static const uint8_t codelen_order[19] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+struct inf_stream {
+	/* Start of the deflate data, bit offsets count from here */
+	const uint8_t* start;
+	const uint8_t* in;
+	const uint8_t* in_end;
+	/*
+	 * Bits read ahead of in, lowest first. Only the low bitcnt bits count,
+	 * bits above them are either zero or what the next bytes at in hold.
+	 */
+	uint64_t bitbuf;
+	unsigned bitcnt;
+	int state;
+	int final;
+	/* Bytes left in a stored block */
+	size_t stored;
+	/* Match left over when out filled up */
+	unsigned copy_len;
+	unsigned copy_dist;
+	/* Bit offset of the block to stop before, 0 to go on to the end */
+	uint64_t stop;
+	/* Tables of the current block, either the fixed ones or dyn_* */
+	const uint32_t* litlen;
+	const uint32_t* dist;
+	uint32_t dyn_litlen[LITLEN_SIZE];
+	uint32_t dyn_dist[DIST_SIZE];
+};
+
+/*
+ * Tables of the fixed code, built once on first use. Its codes are never
+ * longer than a main table, so no room is needed for subtables.
+ */
+static uint32_t fixed_litlen[1 << LITLEN_BITS];
+static uint32_t fixed_dist[1 << DIST_BITS];
+static pthread_once_t fixed_once = PTHREAD_ONCE_INIT;
+
+static ALWAYS_INLINE uint64_t
+_load_le64(const uint8_t* p) {
+
+	uint64_t v;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(&v, p, 8);
+#else
+	v = 0;
+	for (int i = 7; i >= 0; i--) {
+		v = (v << 8) | p[i];
+	}
+#endif
+
+	return v;
+
+}
+
+/* Reads bytes into the bit buffer one at a time, never reading past in_end. */
+#define REFILL_SLOW() \
+	while (bitcnt < 56 && in < in_end) { \
+		bitbuf |= (uint64_t) *(in++) << bitcnt; \
+		bitcnt += 8; \
+	}
+
+/*
+ * Reads 8 bytes at once and keeps the whole bytes that fit, in must be at
+ * least 8 bytes from in_end. Leaves at least 56 bits in the buffer.
+ */
+#define REFILL_FAST() \
+	do { \
+		bitbuf |= _load_le64(in) << bitcnt; \
+		in += (63 - bitcnt) >> 3; \
+		bitcnt |= 56; \
+	} while (0)
+
+#define CONSUME(n) \
+	do { \
+		bitbuf >>= (n); \
+		bitcnt -= (n); \
+	} while (0)
+
+#define LOW_BITS(n) ((unsigned) bitbuf & ((1u << (n)) - 1))
+
+/* Offset of the next bit to be read, counted from the start of the data */
+#define BIT_POS() ((uint64_t) (in - s->start) * 8 - bitcnt)
+
+static unsigned
+_reverse(unsigned code, int len) {
+
+	unsigned rev = 0;
+
+	while (len-- > 0) {
+		rev = (rev << 1) | (code & 1);
+		code >>= 1;
+	}
+
+	return rev;
+
+}
+
+static uint32_t
+_sym_entry(int type, unsigned sym) {
+
+	switch (type) {
+	case T_LITLEN:
+		if (sym < 256) {
+			return ENTRY(K_LIT, 0, sym);
+		} else if (sym == 256) {
+			return ENTRY(K_EOB, 0, 0);
+		} else if (sym < 286) {
+			return ENTRY(K_LEN, len_extra[sym - 257], len_base[sym - 257]);
+		}
+		return ENTRY(K_BAD, 0, 0);
+	case T_DIST:
+		if (sym < 30) {
+			return ENTRY(K_DIST, dist_extra[sym], dist_base[sym]);
+		}
+		return ENTRY(K_BAD, 0, 0);
+	default:
+		return ENTRY(K_LIT, 0, sym);
+	}
+
+}
+
+/*
+ * Builds the decode table of a canonical Huffman code from the code lengths
+ * of its num symbols. Like tinfl, codes that are over-subscribed, or that are
+ * incomplete while using more than one symbol, are refused with -1. Returns 1
+ * for the incomplete codes that are let through, 0 for complete ones.
+ */
+static int
+_build_table(uint32_t* table, int bits, const uint8_t* lens, int num,
+             int type) {
+
+	unsigned count[16] = { 0 };
+	unsigned next[16];
+	unsigned used = 0, total = 0, code = 0;
+	int maxlen = 0, subbits;
+	size_t subnext = (size_t) 1 << bits;
+
+	for (int i = 0; i < num; i++) {
+		count[lens[i]]++;
+	}
+
+	count[0] = 0;
+
+	for (int len = 1; len < 16; len++) {
+		used += count[len];
+		total += count[len] << (15 - len);
+		if (count[len] > 0) {
+			maxlen = len;
+		}
+		code = (code + count[len - 1]) << 1;
+		next[len] = code;
+	}
+
+	if (total > (1u << 15) || (total != (1u << 15) && used > 1)) {
+		return -1;
+	}
+
+	subbits = maxlen > bits ? maxlen - bits : 0;
+
+	for (size_t i = 0; i < subnext; i++) {
+		table[i] = ENTRY(K_BAD, 0, 0);
+	}
+
+	for (int sym = 0; sym < num; sym++) {
+
+		int len = lens[sym];
+		unsigned rev;
+		uint32_t entry;
+		uint32_t* sub;
+
+		if (len == 0) {
+			continue;
+		}
+
+		rev = _reverse(next[len]++, len);
+		entry = _sym_entry(type, sym) | len;
+
+		if (len <= bits) {
+			for (unsigned i = rev; i < (1u << bits); i += 1u << len) {
+				table[i] = entry;
+			}
+			continue;
+		}
+
+		/* Every code sharing the first bits goes in the same subtable */
+		sub = &table[rev & ((1u << bits) - 1)];
+
+		if (ENT_KIND(*sub) != K_SUB) {
+			*sub = ENTRY(K_SUB, subbits, subnext) | bits;
+			for (size_t i = 0; i < ((size_t) 1 << subbits); i++) {
+				table[subnext + i] = ENTRY(K_BAD, 0, 0);
+			}
+			subnext += (size_t) 1 << subbits;
+		}
+
+		sub = table + ENT_VALUE(*sub);
+
+		for (unsigned i = rev >> bits; i < (1u << subbits);
+			i += 1u << (len - bits)) {
+			sub[i] = entry;
+		}
+
+	}
+
+	return total != (1u << 15);
+
+}
+
+/*
+ * Turns literals whose code is followed by room for another literal's code in
+ * the main table into pairs, so runs of literals take half the lookups. Going
+ * backwards, the entry of the bits after a literal is always still a single
+ * symbol when it is looked at.
+ */
+static void
+_pair_literals(uint32_t* table) {
+
+	for (int i = (1 << LITLEN_BITS) - 1; i >= 0; i--) {
+
+		uint32_t first = table[i];
+		uint32_t second;
+		unsigned n;
+
+		if (ENT_KIND(first) != K_LIT || (n = ENT_BITS(first)) >= LITLEN_BITS) {
+			continue;
+		}
+
+		second = table[i >> n];
+
+		if (ENT_KIND(second) != K_LIT || n + ENT_BITS(second) > LITLEN_BITS) {
+			continue;
+		}
+
+		table[i] = ENTRY(K_LIT2, n, ENT_VALUE(first) | ENT_VALUE(second) << 8)
+			| (n + ENT_BITS(second));
+
+	}
+
+}
+
+/* Refills the stream's bit buffer as far as its input allows. */
+static void
+_refill(struct inf_stream* s) {
+
+	const uint8_t* in = s->in;
+	const uint8_t* in_end = s->in_end;
+	uint64_t bitbuf = s->bitbuf;
+	unsigned bitcnt = s->bitcnt;
+
+	REFILL_SLOW();
+
+	s->in = in;
+	s->bitbuf = bitbuf;
+	s->bitcnt = bitcnt;
+
+}
+
+/* Takes n bits off the stream into value, returns -1 if it runs out. */
+static int
+_get_bits(struct inf_stream* s, unsigned n, unsigned* value) {
+
+	_refill(s);
+
+	if (s->bitcnt < n) {
+		return -1;
+	}
+
+	*value = s->bitbuf & ((1u << n) - 1);
+	s->bitbuf >>= n;
+	s->bitcnt -= n;
+
+	return 0;
+
+}
+
+static void
+_build_fixed(void) {
+
+	uint8_t lens[288];
+
+	memset(lens, 8, 144);
+	memset(lens + 144, 9, 112);
+	memset(lens + 256, 7, 24);
+	memset(lens + 280, 8, 8);
+
+	_build_table(fixed_litlen, LITLEN_BITS, lens, 288, T_LITLEN);
+	_pair_literals(fixed_litlen);
+
+	memset(lens, 5, 32);
+
+	_build_table(fixed_dist, DIST_BITS, lens, 32, T_DIST);
+
+}
+
+/*
+ * Reads the code lengths of a dynamic block and builds its tables. If strict
+ * is set, anything a real deflater would not write is refused as well, see
+ * _find_block.
+ */
+static int
+_read_dynamic(struct inf_stream* s, int strict) {
+
+	uint8_t lens[288 + 32];
+	uint8_t codelens[19] = { 0 };
+	uint32_t table[1 << CODELEN_BITS];
+	unsigned hlit, hdist, hclen, value;
+	unsigned i = 0;
+	int incomplete;
+
+	if (_get_bits(s, 5, &hlit) == -1 || _get_bits(s, 5, &hdist) == -1
+		|| _get_bits(s, 4, &hclen) == -1) {
+		return -1;
+	}
+
+	hlit += 257;
+	hdist += 1;
+	hclen += 4;
+
+	if (strict && (hlit > 286 || hdist > 30)) {
+		return -1;
+	}
+
+	for (unsigned j = 0; j < hclen; j++) {
+		if (_get_bits(s, 3, &value) == -1) {
+			return -1;
+		}
+		codelens[codelen_order[j]] = value;
+	}
+
+	incomplete = _build_table(table, CODELEN_BITS, codelens, 19, T_CODELEN);
+
+	if (incomplete == -1 || (strict && incomplete)) {
+		return -1;
+	}
+
+	while (i < hlit + hdist) {
+
+		uint32_t e;
+		unsigned sym, repeat;
+		uint8_t fill = 0;
+
+		/* Code length codes are never longer than CODELEN_BITS */
+		_refill(s);
+
+		e = table[s->bitbuf & ((1u << CODELEN_BITS) - 1)];
+
+		if (ENT_KIND(e) == K_BAD || ENT_BITS(e) > s->bitcnt) {
+			return -1;
+		}
+
+		_get_bits(s, ENT_BITS(e), &value);
+		sym = ENT_VALUE(e);
+
+		if (sym < 16) {
+			lens[i++] = sym;
+			continue;
+		}
+
+		if (sym == 16) {
+			if (i == 0 || _get_bits(s, 2, &repeat) == -1) {
+				return -1;
+			}
+			fill = lens[i - 1];
+			repeat += 3;
+		} else if (sym == 17) {
+			if (_get_bits(s, 3, &repeat) == -1) {
+				return -1;
+			}
+			repeat += 3;
+		} else {
+			if (_get_bits(s, 7, &repeat) == -1) {
+				return -1;
+			}
+			repeat += 11;
+		}
+
+		if (i + repeat > hlit + hdist) {
+			return -1;
+		}
+
+		memset(lens + i, fill, repeat);
+		i += repeat;
+
+	}
+
+	if (strict && lens[256] == 0) {
+		return -1;
+	}
+
+	incomplete = _build_table(s->dyn_litlen, LITLEN_BITS, lens, hlit, T_LITLEN);
+
+	if (incomplete == -1 || (strict && incomplete)
+		|| _build_table(s->dyn_dist, DIST_BITS, lens + hlit, hdist, T_DIST)
+		== -1) {
+		return -1;
+	}
+
+	_pair_literals(s->dyn_litlen);
+
+	return 0;
+
+}
+
+static int
+_read_block_header(struct inf_stream* s) {
+
+	unsigned header, len;
+
+	if (_get_bits(s, 3, &header) == -1) {
+		return -1;
+	}
+
+	s->final = header & 1;
+
+	switch (header >> 1) {
+	case 0:
+		/* Stored blocks start on a byte, give back the whole bytes read */
+		_get_bits(s, s->bitcnt & 7, &len);
+		s->in -= s->bitcnt >> 3;
+		s->bitbuf = 0;
+		s->bitcnt = 0;
+
+		if (s->in_end - s->in < 4) {
+			return -1;
+		}
+
+		len = s->in[0] | s->in[1] << 8;
+
+		if (len != (~(s->in[2] | s->in[3] << 8) & 0xFFFFu)) {
+			return -1;
+		}
+
+		s->in += 4;
+		s->stored = len;
+		s->state = S_STORED;
+		return 0;
+	case 1:
+		pthread_once(&fixed_once, _build_fixed);
+		s->litlen = fixed_litlen;
+		s->dist = fixed_dist;
+		s->state = S_HUFFMAN;
+		return 0;
+	case 2:
+		if (_read_dynamic(s, 0) == -1) {
+			return -1;
+		}
+		s->litlen = s->dyn_litlen;
+		s->dist = s->dyn_dist;
+		s->state = S_HUFFMAN;
+		return 0;
+	default:
+		return -1;
+	}
+
+}
+
+/* Sets up s to inflate the size bytes at in, from bit offset bit on. */
+static void
+_init_stream(struct inf_stream* s, const uint8_t* in, size_t size,
+             uint64_t bit) {
+
+	unsigned skipped;
+
+	s->start = in;
+	s->in = in + bit / 8;
+	s->in_end = in + size;
+	s->bitbuf = 0;
+	s->bitcnt = 0;
+	s->state = S_HEADER;
+	s->final = 0;
+	s->litlen = NULL;
+	s->dist = NULL;
+	s->stored = 0;
+	s->copy_len = 0;
+	s->copy_dist = 0;
+	s->stop = 0;
+
+	if (bit & 7) {
+		_get_bits(s, bit & 7, &skipped);
+	}
+
+}
+
+/*
+ * Whether the bits from bit on could start a dynamic block that is not the
+ * last, judged from its counts and code length code lengths alone. That
+ * turns down nearly every offset without building any table. in must hold at
+ * least 16 bytes from bit / 8 on.
+ */
+static int
+_maybe_block(const uint8_t* in, uint64_t bit) {
+
+	uint64_t v = _load_le64(in + bit / 8) >> (bit & 7);
+	unsigned hclen, len, kraft = 0;
+
+	/* Not the last block, dynamic, at most 286 and 30 codes */
+	if ((v & 7) != 4 || ((v >> 3) & 0x1F) > 29 || ((v >> 8) & 0x1F) > 29) {
+		return 0;
+	}
+
+	hclen = ((v >> 13) & 0xF) + 4;
+	bit += 17;
+	v = _load_le64(in + bit / 8) >> (bit & 7);
+
+	/* The code length code has to be complete */
+	for (unsigned i = 0; i < hclen; i++, v >>= 3) {
+		if ((len = v & 7) > 0) {
+			kraft += 128 >> len;
+		}
+	}
+
+	return kraft == 128;
+
+}
+
+/*
+ * Looks for the first dynamic block starting at a bit offset from from up to
+ * to, and leaves s ready to inflate it. Nearly any offset can pass for the
+ * start of a block, so only headers a real deflater writes are taken, see
+ * _read_dynamic, and never the last block. Returns the offset, 0 if none was
+ * found.
+ */
+static uint64_t
+_find_block(struct inf_stream* s, const uint8_t* in, size_t size,
+            uint64_t from, uint64_t to) {
+
+	unsigned header;
+
+	for (uint64_t bit = from; bit < to && bit / 8 + 16 <= size; bit++) {
+
+		if (!_maybe_block(in, bit)) {
+			continue;
+		}
+
+		_init_stream(s, in, size, bit);
+		_get_bits(s, 3, &header);
+
+		if (_read_dynamic(s, 1) == 0) {
+			s->litlen = s->dyn_litlen;
+			s->dist = s->dyn_dist;
+			s->state = S_HUFFMAN;
+			return bit;
+		}
+
+	}
+
+	return 0;
+
+}
+
+/*
+ * Copies a match of len bytes from dist bytes back, writing up to 15 bytes
+ * past its end.
+ */
+static ALWAYS_INLINE void
+_copy_match(uint8_t* out, unsigned dist, unsigned len) {
+
+	const uint8_t* src = out - dist;
+	uint8_t* end = out + len;
+	uint8_t pattern[16];
+	unsigned step;
+
+	if (dist >= 16) {
+		do {
+			memcpy(out, src, 16);
+			out += 16;
+			src += 16;
+		} while (out < end);
+		return;
+	}
+
+	/*
+	 * Copying a word at a time would read back what was just written. The
+	 * match repeats every dist bytes, so lay 16 bytes of it down once and
+	 * store those over and over, moving on by the most whole repeats they
+	 * hold.
+	 */
+	memcpy(pattern, src, dist);
+
+	for (unsigned i = dist; i < 16; i++) {
+		pattern[i] = pattern[i - dist];
+	}
+
+	step = 16 - 16 % dist;
+
+	do {
+		memcpy(out, pattern, 16);
+		out += step;
+	} while (out < end);
+
+}
+
+#define LOOKUP(table, tablebits, e) \
+	do { \
+		e = (table)[bitbuf & ((1u << (tablebits)) - 1)]; \
+		if (ENT_KIND(e) == K_SUB) { \
+			e = (table)[ENT_VALUE(e) \
+				+ ((bitbuf >> (tablebits)) & ((1u << ENT_EXTRA(e)) - 1))]; \
+		} \
+	} while (0)
+
+static ALWAYS_INLINE int
+_inflate(struct inf_stream* s, uint8_t* out, size_t* outpos, size_t outsize) {
+
+	const uint8_t* in = s->in;
+	const uint8_t* in_end = s->in_end;
+	uint64_t bitbuf = s->bitbuf;
+	unsigned bitcnt = s->bitcnt;
+	uint8_t* o = out + *outpos;
+	uint8_t* o_end = out + outsize;
+	/* Kept out of s, so writing output does not make them be read again */
+	const uint32_t* litlen_table = s->litlen;
+	const uint32_t* dist_table = s->dist;
+	uint32_t e;
+	unsigned len, dist;
+	size_t n;
+	int rtrn = INF_ERROR;
+
+	/* Finish the match that was cut short last time */
+	if (s->copy_len > 0) {
+
+		n = (size_t) (o_end - o) < s->copy_len ? (size_t) (o_end - o)
+			: s->copy_len;
+
+		for (size_t i = 0; i < n; i++, o++) {
+			*o = *(o - s->copy_dist);
+		}
+
+		if ((s->copy_len -= n) > 0) {
+			rtrn = INF_MORE;
+			goto end;
+		}
+
+	}
+
+	for (;;) {
+
+		switch (s->state) {
+		case S_HEADER:
+			/* Chunks of a parallel inflate end where the next one starts */
+			if (s->stop > 0 && (BIT_POS() >= s->stop || s->final)) {
+				rtrn = BIT_POS() == s->stop && !s->final ? INF_DONE
+					: INF_ERROR;
+				goto end;
+			}
+			if (s->final) {
+				s->state = S_DONE;
+				continue;
+			}
+			s->in = in;
+			s->bitbuf = bitbuf;
+			s->bitcnt = bitcnt;
+			if (_read_block_header(s) == -1) {
+				goto end;
+			}
+			in = s->in;
+			bitbuf = s->bitbuf;
+			bitcnt = s->bitcnt;
+			litlen_table = s->litlen;
+			dist_table = s->dist;
+			continue;
+		case S_STORED:
+			n = (size_t) (o_end - o) < s->stored ? (size_t) (o_end - o)
+				: s->stored;
+			if ((size_t) (in_end - in) < n) {
+				goto end;
+			}
+			memcpy(o, in, n);
+			o += n;
+			in += n;
+			if ((s->stored -= n) > 0) {
+				rtrn = INF_MORE;
+				goto end;
+			}
+			s->state = S_HEADER;
+			continue;
+		case S_DONE:
+			rtrn = INF_DONE;
+			goto end;
+		}
+
+		/* One refill covers the longest length and distance codes */
+		while (in_end - in >= 8 && o_end - o >= FAST_ROOM) {
+
+			REFILL_FAST();
+
+			LOOKUP(litlen_table, LITLEN_BITS, e);
+			CONSUME(ENT_BITS(e));
+
+			if (ENT_KIND(e) == K_LIT2) {
+				o[0] = ENT_VALUE(e) & 0xFF;
+				o[1] = ENT_VALUE(e) >> 8;
+				o += 2;
+				continue;
+			}
+
+			if (ENT_KIND(e) == K_LIT) {
+				*(o++) = ENT_VALUE(e);
+				continue;
+			}
+
+			if (ENT_KIND(e) != K_LEN) {
+				if (ENT_KIND(e) != K_EOB) {
+					goto end;
+				}
+				s->state = S_HEADER;
+				break;
+			}
+
+			len = ENT_VALUE(e) + LOW_BITS(ENT_EXTRA(e));
+			CONSUME(ENT_EXTRA(e));
+
+			LOOKUP(dist_table, DIST_BITS, e);
+			CONSUME(ENT_BITS(e));
+
+			if (ENT_KIND(e) != K_DIST) {
+				goto end;
+			}
+
+			dist = ENT_VALUE(e) + LOW_BITS(ENT_EXTRA(e));
+			CONSUME(ENT_EXTRA(e));
+
+			if (dist > (size_t) (o - out)) {
+				goto end;
+			}
+
+			_copy_match(o, dist, len);
+			o += len;
+
+		}
+
+		/* Careful loop, for the end of the input or output */
+		while (s->state == S_HUFFMAN) {
+
+			REFILL_SLOW();
+
+			LOOKUP(litlen_table, LITLEN_BITS, e);
+
+			/* Not enough room or bits for the second of a pair */
+			if (ENT_KIND(e) == K_LIT2 && (o_end - o < 2 || ENT_BITS(e) > bitcnt)) {
+				e = ENTRY(K_LIT, 0, ENT_VALUE(e) & 0xFF) | ENT_EXTRA(e);
+			}
+
+			if (ENT_BITS(e) > bitcnt || ENT_KIND(e) == K_BAD) {
+				goto end;
+			}
+
+			if (ENT_KIND(e) == K_LIT || ENT_KIND(e) == K_LIT2) {
+
+				if (o == o_end) {
+					rtrn = INF_MORE;
+					goto end;
+				}
+
+				*(o++) = ENT_VALUE(e) & 0xFF;
+
+				if (ENT_KIND(e) == K_LIT2) {
+					*(o++) = ENT_VALUE(e) >> 8;
+				}
+
+				CONSUME(ENT_BITS(e));
+				continue;
+
+			}
+
+			CONSUME(ENT_BITS(e));
+
+			if (ENT_KIND(e) == K_EOB) {
+				s->state = S_HEADER;
+				break;
+			}
+
+			if (ENT_EXTRA(e) > bitcnt) {
+				goto end;
+			}
+
+			len = ENT_VALUE(e) + LOW_BITS(ENT_EXTRA(e));
+			CONSUME(ENT_EXTRA(e));
+
+			LOOKUP(dist_table, DIST_BITS, e);
+
+			if (ENT_KIND(e) != K_DIST || ENT_BITS(e) + ENT_EXTRA(e) > bitcnt) {
+				goto end;
+			}
+
+			CONSUME(ENT_BITS(e));
+			dist = ENT_VALUE(e) + LOW_BITS(ENT_EXTRA(e));
+			CONSUME(ENT_EXTRA(e));
+
+			if (dist > (size_t) (o - out)) {
+				goto end;
+			}
+
+			n = (size_t) (o_end - o) < len ? (size_t) (o_end - o) : len;
+
+			for (size_t i = 0; i < n; i++, o++) {
+				*o = *(o - dist);
+			}
+
+			if (n < len) {
+				s->copy_len = len - n;
+				s->copy_dist = dist;
+				rtrn = INF_MORE;
+				goto end;
+			}
+
+		}
+
+	}
+
+end:
+	s->in = in;
+	s->bitbuf = bitbuf;
+	s->bitcnt = bitcnt;
+	*outpos = o - out;
+
+	return rtrn;
+
+}
+
+/*
+ * Values a chunk of a parallel inflate is decoded into, before the INF_WINDOW
+ * bytes in front of it are known. Values below MARKER_WINDOW are bytes,
+ * MARKER_WINDOW + i stands for byte i of that window.
+ */
+#define MARKER_WINDOW 256
+
+/*
+ * Copies n values of a match from dist back to out + pos, values from before
+ * the chunk become window markers. Returns -1 if the match reaches back
+ * further than the window.
+ */
+static ALWAYS_INLINE int
+_copy_markers(uint16_t* out, size_t pos, unsigned dist, size_t n) {
+
+	if (dist > pos + INF_WINDOW) {
+		return -1;
+	}
+
+	for (; n > 0 && dist > pos; n--, pos++) {
+		out[pos] = MARKER_WINDOW + INF_WINDOW - (dist - pos);
+	}
+
+	for (; n > 0; n--, pos++) {
+		out[pos] = out[pos - dist];
+	}
+
+	return 0;
+
+}
+
+/*
+ * Same as _inflate, but into markers, for a chunk that starts somewhere in the
+ * middle of the data. Each value is handled on its own, so there is no fast
+ * loop besides refilling.
+ */
+static ALWAYS_INLINE int
+_inflate_markers(struct inf_stream* s, uint16_t* out, size_t* outpos,
+                 size_t outsize) {
+
+	const uint8_t* in = s->in;
+	const uint8_t* in_end = s->in_end;
+	uint64_t bitbuf = s->bitbuf;
+	unsigned bitcnt = s->bitcnt;
+	size_t pos = *outpos;
+	const uint32_t* litlen_table = s->litlen;
+	const uint32_t* dist_table = s->dist;
+	uint32_t e;
+	unsigned len, dist;
+	size_t n;
+	int rtrn = INF_ERROR;
+
+	if (s->copy_len > 0) {
+
+		n = outsize - pos < s->copy_len ? outsize - pos : s->copy_len;
+
+		if (_copy_markers(out, pos, s->copy_dist, n) == -1) {
+			goto end;
+		}
+
+		pos += n;
+
+		if ((s->copy_len -= n) > 0) {
+			rtrn = INF_MORE;
+			goto end;
+		}
+
+	}
+
+	for (;;) {
+
+		switch (s->state) {
+		case S_HEADER:
+			if (s->stop > 0 && (BIT_POS() >= s->stop || s->final)) {
+				rtrn = BIT_POS() == s->stop && !s->final ? INF_DONE
+					: INF_ERROR;
+				goto end;
+			}
+			if (s->final) {
+				s->state = S_DONE;
+				continue;
+			}
+			s->in = in;
+			s->bitbuf = bitbuf;
+			s->bitcnt = bitcnt;
+			if (_read_block_header(s) == -1) {
+				goto end;
+			}
+			in = s->in;
+			bitbuf = s->bitbuf;
+			bitcnt = s->bitcnt;
+			litlen_table = s->litlen;
+			dist_table = s->dist;
+			continue;
+		case S_STORED:
+			n = outsize - pos < s->stored ? outsize - pos : s->stored;
+			if ((size_t) (in_end - in) < n) {
+				goto end;
+			}
+			for (size_t i = 0; i < n; i++) {
+				out[pos++] = *(in++);
+			}
+			if ((s->stored -= n) > 0) {
+				rtrn = INF_MORE;
+				goto end;
+			}
+			s->state = S_HEADER;
+			continue;
+		case S_DONE:
+			rtrn = INF_DONE;
+			goto end;
+		}
+
+		while (s->state == S_HUFFMAN) {
+
+			if (in_end - in >= 8) {
+				REFILL_FAST();
+			} else {
+				REFILL_SLOW();
+			}
+
+			LOOKUP(litlen_table, LITLEN_BITS, e);
+
+			if (ENT_KIND(e) == K_LIT2 && (outsize - pos < 2
+				|| ENT_BITS(e) > bitcnt)) {
+				e = ENTRY(K_LIT, 0, ENT_VALUE(e) & 0xFF) | ENT_EXTRA(e);
+			}
+
+			if (ENT_BITS(e) > bitcnt || ENT_KIND(e) == K_BAD) {
+				goto end;
+			}
+
+			if (ENT_KIND(e) == K_LIT || ENT_KIND(e) == K_LIT2) {
+
+				if (pos == outsize) {
+					rtrn = INF_MORE;
+					goto end;
+				}
+
+				out[pos++] = ENT_VALUE(e) & 0xFF;
+
+				if (ENT_KIND(e) == K_LIT2) {
+					out[pos++] = ENT_VALUE(e) >> 8;
+				}
+
+				CONSUME(ENT_BITS(e));
+				continue;
+
+			}
+
+			CONSUME(ENT_BITS(e));
+
+			if (ENT_KIND(e) == K_EOB) {
+				s->state = S_HEADER;
+				break;
+			}
+
+			if (ENT_EXTRA(e) > bitcnt) {
+				goto end;
+			}
+
+			len = ENT_VALUE(e) + LOW_BITS(ENT_EXTRA(e));
+			CONSUME(ENT_EXTRA(e));
+
+			LOOKUP(dist_table, DIST_BITS, e);
+
+			if (ENT_KIND(e) != K_DIST || ENT_BITS(e) + ENT_EXTRA(e) > bitcnt) {
+				goto end;
+			}
+
+			CONSUME(ENT_BITS(e));
+			dist = ENT_VALUE(e) + LOW_BITS(ENT_EXTRA(e));
+			CONSUME(ENT_EXTRA(e));
+
+			n = outsize - pos < len ? outsize - pos : len;
+
+			if (_copy_markers(out, pos, dist, n) == -1) {
+				goto end;
+			}
+
+			pos += n;
+
+			if (n < len) {
+				s->copy_len = len - n;
+				s->copy_dist = dist;
+				rtrn = INF_MORE;
+				goto end;
+			}
+
+		}
+
+	}
+
+end:
+	s->in = in;
+	s->bitbuf = bitbuf;
+	s->bitcnt = bitcnt;
+	*outpos = pos;
+
+	return rtrn;
+
+}
+
+static int
+_inflate_base(struct inf_stream* s, uint8_t* out, size_t* outpos,
+              size_t outsize) {
+
+	return _inflate(s, out, outpos, outsize);
+
+}
+
+static int
+_inflate_markers_base(struct inf_stream* s, uint16_t* out, size_t* outpos,
+                      size_t outsize) {
+
+	return _inflate_markers(s, out, outpos, outsize);
+
+}
+
+#ifdef HAVE_BMI2_KERNEL
+__attribute__((target("bmi2")))
+static int
+_inflate_bmi2(struct inf_stream* s, uint8_t* out, size_t* outpos,
+              size_t outsize) {
+
+	return _inflate(s, out, outpos, outsize);
+
+}
+
+__attribute__((target("bmi2")))
+static int
+_inflate_markers_bmi2(struct inf_stream* s, uint16_t* out, size_t* outpos,
+                      size_t outsize) {
+
+	return _inflate_markers(s, out, outpos, outsize);
+
+}
+#endif
+
+/*
+ * Values a chunk is decoded into at once, until its last INF_WINDOW values are
+ * all bytes and it can go on into bytes, see _decode_chunk.
+ */
+#define MARKER_STEP (256 * 1024)
+
+/*
+ * Farthest into its share of the data a chunk looks for a block. Deflaters
+ * rarely write blocks longer than a few dozen KB, data without any dynamic
+ * blocks should not be scanned in full.
+ */
+#define SEARCH_BITS (128 * 1024 * 8)
+
+/* Part of the data inflated by one thread of inf_inflate_parallel */
+struct inf_chunk {
+	struct inf_stream* stream;
+	const uint8_t* in;
+	size_t size;
+	/* Bit offsets to look for the chunk's first block between */
+	uint64_t from;
+	uint64_t to;
+	/* Bit offset of the chunk's first block, 0 for the first chunk */
+	uint64_t bit;
+	/* The whole output */
+	uint8_t* out;
+	size_t outsize;
+	/*
+	 * Start of the chunk's output in markers, NULL for the first chunk which
+	 * inflates right to out.
+	 */
+	uint16_t* markers;
+	size_t cap;
+	size_t len;
+	/*
+	 * Rest of the chunk's output in bytes, behind INF_WINDOW bytes of history.
+	 * NULL if all of it is in markers.
+	 */
+	uint8_t* bytes;
+	size_t bytes_cap;
+	size_t bytes_len;
+	/* Where the chunk's output goes in the whole */
+	size_t ofs;
+	int rtrn;
+};
+
+static int
+_inflate_any_markers(struct inf_stream* s, uint16_t* out, size_t* outpos,
+                     size_t outsize) {
+
+#ifdef HAVE_BMI2_KERNEL
+	if (__builtin_cpu_supports("bmi2")) {
+		return _inflate_markers_bmi2(s, out, outpos, outsize);
+	}
+#endif
+
+	return _inflate_markers_base(s, out, outpos, outsize);
+
+}
+
+static void*
+_search_chunk(void* arg) {
+
+	struct inf_chunk* c = arg;
+
+	if (c->from > 0) {
+		c->bit = _find_block(c->stream, c->in, c->size, c->from, c->to);
+	}
+
+	return NULL;
+
+}
+
+/* Whether the n values at markers are all bytes */
+static int
+_all_bytes(const uint16_t* markers, size_t n) {
+
+	unsigned any = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		any |= markers[i];
+	}
+
+	return any < MARKER_WINDOW;
+
+}
+
+/* Grows a chunk buffer of *cap elements of size to at least need elements. */
+static int
+_grow(void** buf, size_t* cap, size_t need, size_t size) {
+
+	size_t newcap = *cap;
+	void* p;
+
+	while (newcap < need) {
+		newcap *= 2;
+	}
+
+	if (newcap == *cap) {
+		return 0;
+	}
+
+	if ((p = realloc(*buf, newcap * size)) == NULL) {
+		return -1;
+	}
+
+	*buf = p;
+	*cap = newcap;
+
+	return 0;
+
+}
+
+/*
+ * Decodes a chunk into markers MARKER_STEP values at a time. As soon as the
+ * last INF_WINDOW of them no longer stand for anything before the chunk,
+ * nothing after them can either, so the rest of the chunk is inflated as
+ * bytes by inf_inflate, with those values as history.
+ */
+static void*
+_decode_chunk(void* arg) {
+
+	struct inf_chunk* c = arg;
+	size_t step;
+
+	if (c->markers == NULL) {
+		c->rtrn = inf_inflate(c->stream, c->out, &c->len, c->outsize);
+		return NULL;
+	}
+
+	/* A chunk can never come out longer than the whole */
+	for (;;) {
+
+		step = c->outsize - c->len < MARKER_STEP ? c->outsize - c->len
+			: MARKER_STEP;
+
+		if (_grow((void**) &c->markers, &c->cap, c->len + step,
+			sizeof(uint16_t)) == -1) {
+			c->rtrn = INF_ERROR;
+			return NULL;
+		}
+
+		c->rtrn = _inflate_any_markers(c->stream, c->markers, &c->len,
+			c->len + step);
+
+		if (c->rtrn != INF_MORE || c->len == c->outsize) {
+			return NULL;
+		}
+
+		if (c->len >= INF_WINDOW
+			&& _all_bytes(c->markers + c->len - INF_WINDOW, INF_WINDOW)) {
+			break;
+		}
+
+	}
+
+	c->bytes_cap = INF_WINDOW + MARKER_STEP;
+
+	if ((c->bytes = malloc(c->bytes_cap)) == NULL) {
+		c->rtrn = INF_ERROR;
+		return NULL;
+	}
+
+	for (size_t i = 0; i < INF_WINDOW; i++) {
+		c->bytes[i] = c->markers[c->len - INF_WINDOW + i];
+	}
+
+	c->bytes_len = INF_WINDOW;
+
+	while ((c->rtrn = inf_inflate(c->stream, c->bytes, &c->bytes_len,
+		c->bytes_cap)) == INF_MORE) {
+
+		if (c->bytes_cap - INF_WINDOW >= c->outsize - c->len
+			|| _grow((void**) &c->bytes, &c->bytes_cap, c->bytes_cap + 1, 1)
+			== -1) {
+			c->rtrn = INF_ERROR;
+			break;
+		}
+
+	}
+
+	c->bytes_len -= INF_WINDOW;
+
+	return NULL;
+
+}
+
+/*
+ * Puts the chunk's output from from up to to in place in the whole. Markers
+ * are turned into bytes, the INF_WINDOW bytes before the chunk have to be in
+ * place already for that.
+ */
+static void
+_place(struct inf_chunk* c, size_t from, size_t to) {
+
+	uint8_t* out = c->out + c->ofs;
+	const uint8_t* window = out - INF_WINDOW;
+	size_t i = from;
+	unsigned m;
+
+	for (; i < to && i < c->len; i++) {
+		m = c->markers[i];
+		out[i] = m < MARKER_WINDOW ? m : window[m - MARKER_WINDOW];
+	}
+
+	if (i < to) {
+		memcpy(out + i, c->bytes + INF_WINDOW + (i - c->len), to - i);
+	}
+
+}
+
+/* Places all of a chunk but its last INF_WINDOW, see inf_inflate_parallel */
+static void*
+_place_chunk(void* arg) {
+
+	struct inf_chunk* c = arg;
+	size_t total = c->len + c->bytes_len;
+
+	if (c->markers != NULL && total > INF_WINDOW) {
+		_place(c, 0, total - INF_WINDOW);
+	}
+
+	return NULL;
+
+}
+
+/*
+ * Runs func on each of the n chunks, on a thread of its own. Chunks a thread
+ * could not be started for are run on the calling thread.
+ */
+static void
+_run_chunks(struct inf_chunk* chunks, int n, void* (*func)(void*)) {
+
+	pthread_t* threads;
+	char* started;
+
+	threads = malloc(n * sizeof(pthread_t));
+	started = calloc(n, 1);
+
+	for (int i = 1; i < n; i++) {
+		if (threads == NULL || started == NULL
+			|| pthread_create(&threads[i], NULL, func, &chunks[i]) != 0) {
+			func(&chunks[i]);
+		} else {
+			started[i] = 1;
+		}
+	}
+
+	func(&chunks[0]);
+
+	for (int i = 1; i < n; i++) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+
+	free(threads);
+	free(started);
+
+}
+
+/* Inflates all of in into out on the calling thread. */
+static int
+_inflate_serial(unsigned char* in, size_t size, unsigned char* out,
+                size_t outsize) {
+
+	struct inf_stream* s;
+	size_t outpos = 0;
+	int rtrn;
+
+	if ((s = inf_open(in, size)) == NULL) {
+		return INF_ERROR;
+	}
+
+	rtrn = inf_inflate(s, out, &outpos, outsize);
+	inf_close(s);
+
+	return rtrn == INF_DONE && outpos == outsize ? INF_DONE : INF_ERROR;
+
+}
+
+int
+inf_supported(void) {
+
+	return INF_FAST;
+
+}
+
+struct inf_stream*
+inf_open(unsigned char* in, size_t size) {
+
+	struct inf_stream* s;
+
+	if ((s = malloc(sizeof(struct inf_stream))) == NULL) {
+		return NULL;
+	}
+
+	_init_stream(s, in, size, 0);
+
+	return s;
+
+}
+
+int
+inf_inflate(struct inf_stream* stream, unsigned char* out, size_t* outpos,
+            size_t outsize) {
+
+#ifdef HAVE_BMI2_KERNEL
+	/* The CPU check is a load of what libgcc found at startup. */
+	if (__builtin_cpu_supports("bmi2")) {
+		return _inflate_bmi2(stream, out, outpos, outsize);
+	}
+#endif
+
+	return _inflate_base(stream, out, outpos, outsize);
+
+}
+
+void
+inf_close(struct inf_stream* stream) {
+
+	free(stream);
+
+}
+
+/*
+ * The data is cut into one chunk per thread, and each thread but the first
+ * looks for a block to start from in its chunk. All chunks are then inflated
+ * at once, the first one for real and every other one into markers for as
+ * long as the window before it is still needed. Each chunk has to end where
+ * the next one starts, which only a block found at a true block boundary
+ * allows. Once all of them have, the last INF_WINDOW of each chunk is put in
+ * place in order, after which the rest of the chunks can be put in place at
+ * once. Whenever any of it does not work out, the data is simply inflated
+ * again on one thread.
+ */
+int
+inf_inflate_parallel(unsigned char* in, size_t size, unsigned char* out,
+                     size_t outsize, int threads) {
+
+	struct inf_chunk* chunks;
+	size_t ofs, total;
+	int n, found, rtrn = INF_ERROR;
+
+	n = size / INF_CHUNK_MIN < (size_t) threads ? size / INF_CHUNK_MIN
+		: (size_t) threads;
+
+	if (n < 2 || (chunks = calloc(n, sizeof(struct inf_chunk))) == NULL) {
+		return _inflate_serial(in, size, out, outsize);
+	}
+
+	for (int i = 0; i < n; i++) {
+		if ((chunks[i].stream = malloc(sizeof(struct inf_stream))) == NULL) {
+			goto end;
+		}
+		_init_stream(chunks[i].stream, in, size, 0);
+		chunks[i].in = in;
+		chunks[i].size = size;
+		chunks[i].from = (uint64_t) size * 8 / n * i;
+		chunks[i].to = chunks[i].from + SEARCH_BITS;
+		chunks[i].out = out;
+		chunks[i].outsize = outsize;
+	}
+
+	_run_chunks(chunks, n, _search_chunk);
+
+	/* Chunks without a block of their own are left to the one before */
+	found = 1;
+	for (int i = 1; i < n; i++) {
+		if (chunks[i].bit > 0) {
+			struct inf_chunk c = chunks[found];
+			chunks[found++] = chunks[i];
+			chunks[i] = c;
+		}
+	}
+
+	if (found < 2) {
+		goto end;
+	}
+
+	for (int i = 0; i < found; i++) {
+		chunks[i].stream->stop = i + 1 < found ? chunks[i + 1].bit : 0;
+		if (i == 0) {
+			continue;
+		}
+		chunks[i].cap = MARKER_STEP;
+		chunks[i].markers = malloc(chunks[i].cap * sizeof(uint16_t));
+		if (chunks[i].markers == NULL) {
+			goto end;
+		}
+	}
+
+	_run_chunks(chunks, found, _decode_chunk);
+
+	ofs = 0;
+	for (int i = 0; i < found; i++) {
+		total = chunks[i].len + chunks[i].bytes_len;
+		if (chunks[i].rtrn != INF_DONE || total > outsize - ofs
+			|| (i + 1 < found && total < INF_WINDOW)) {
+			goto end;
+		}
+		chunks[i].ofs = ofs;
+		ofs += total;
+	}
+
+	if (ofs != outsize) {
+		goto end;
+	}
+
+	for (int i = 1; i < found; i++) {
+		total = chunks[i].len + chunks[i].bytes_len;
+		_place(&chunks[i], total > INF_WINDOW ? total - INF_WINDOW : 0, total);
+	}
+
+	_run_chunks(chunks, found, _place_chunk);
+	rtrn = INF_DONE;
+
+end:
+	for (int i = 0; i < n; i++) {
+		free(chunks[i].stream);
+		free(chunks[i].markers);
+		free(chunks[i].bytes);
+	}
+
+	free(chunks);
+
+	return rtrn == INF_DONE ? rtrn : _inflate_serial(in, size, out, outsize);
+
+}
@@ -0,0 +1,57 @@
+/*
+ * Raw deflate decoder, used in place of miniz's tinfl where the CPU can run
+ * it, see inf_supported.
+ */
+
+/* Return values of inf_inflate */
+#define INF_ERROR -1
+#define INF_DONE   0
+#define INF_MORE   1
+
+/* Farthest back a deflate match can reach. */
+#define INF_WINDOW 32768
+
+/*
+ * Least compressed bytes worth a thread of their own in inf_inflate_parallel.
+ * Less than that, and finding where to start takes longer than inflating.
+ */
+#define INF_CHUNK_MIN (512 * 1024)
+
+/* A deflate stream being inflated, its input is given in full up front. */
+struct inf_stream;
+
+/*
+ * Whether inf_inflate is worth using on this CPU. Otherwise tinfl should be
+ * used, which is also what inf_inflate is tested against.
+ */
+int inf_supported(void);
+
+/*
+ * Starts inflating the size bytes of raw deflate data at in. Returns NULL if
+ * memory could not be allocated.
+ */
+/* NOTE: Should be freed using inf_close when no longer in use. */
+struct inf_stream* inf_open(unsigned char* in, size_t size);
+
+/*
+ * Inflates into out from *outpos on, until the stream ends or out is full at
+ * outsize bytes. *outpos is moved past what was inflated. Matches can reach
+ * back as far as the start of out, so when INF_MORE is returned and out has to
+ * be emptied, at least its last INF_WINDOW bytes should be moved to its start
+ * and *outpos set to just past them. Returns INF_DONE once the stream has
+ * ended, INF_MORE if out is full and INF_ERROR if the data is not valid deflate.
+ */
+int inf_inflate(struct inf_stream* stream, unsigned char* out, size_t* outpos,
+                size_t outsize);
+
+/* Frees a stream opened with inf_open */
+void inf_close(struct inf_stream* stream);
+
+/*
+ * Inflates all size bytes of raw deflate data at in into out, which holds the
+ * outsize bytes it inflates to, on up to threads threads at once. Falls back
+ * to a single thread where the data cannot be split up. Returns INF_DONE if
+ * the data inflated to exactly outsize bytes, INF_ERROR otherwise.
+ */
+int inf_inflate_parallel(unsigned char* in, size_t size, unsigned char* out,
+                         size_t outsize, int threads);
@@ -15,8 +15,6 @@ main(int argc, char** argv) {
 		return 0;
 	}
 
-	ebread_run(ebread);
-
-	return 0;
+	return ebread_run(ebread);
 
 }
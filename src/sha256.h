@@ -0,0 +1,26 @@
+/*
+ * SHA-256, see FIPS 180-4. Used where data has to be told apart by its bytes
+ * alone and a CRC-32 could be made to collide on purpose.
+ */
+
+/* Length of a digest in bytes */
+#define SHA256_SIZE 32
+
+/* A digest being computed, see sha256_init. */
+struct sha256 {
+	uint32_t state[8];
+	/* Bytes hashed so far */
+	uint64_t len;
+	/* Bytes waiting for a whole block, buflen of them */
+	uint8_t buf[64];
+	size_t buflen;
+};
+
+/* Starts a new digest */
+void sha256_init(struct sha256* ctx);
+
+/* Hashes len more bytes at data */
+void sha256_update(struct sha256* ctx, const void* data, size_t len);
+
+/* Finishes the digest and writes its SHA256_SIZE bytes to digest */
+void sha256_final(struct sha256* ctx, uint8_t* digest);
@@ -0,0 +1,141 @@
+/*
+ * Checks that uz_unzip_epub keeps every file it extracts under the extract
+ * directory, whatever the entry names in the archive. Names climbing out with
+ * ".." are left out, names with leading slashes are extracted under the
+ * directory as if the slashes were not there, directories included.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../miniz.h"
+#include "../unzip.h"
+
+#define PATHMAX 4096
+
+static int failures;
+
+/* Whether path exists, and should, relative to dir if it is not NULL */
+static void
+_expect(char* dir, char* path, int exists) {
+
+	char full[PATHMAX + 1];
+	struct stat st;
+
+	snprintf(full, sizeof(full), "%s%s", dir != NULL ? dir : "", path);
+
+	if ((stat(full, &st) == 0) != exists) {
+		fprintf(stderr, "FAIL: %s %s\n", full, exists ? "was not extracted"
+			: "was extracted");
+		failures++;
+	}
+
+}
+
+int
+main(void) {
+
+	char tmp[] = "/tmp/ebread_extract_XXXXXX";
+	char epub[PATHMAX + 1];
+	char out[PATHMAX + 1];
+	char abs[64];
+	char absfile[128];
+	mz_zip_archive zip;
+	/* miniz will not write leading slashes, '%' stands in for them */
+	char* names[] = {
+		"mimetype", "../climbed.txt", "OEBPS/../../climbed2.txt",
+		"%%double/lead.txt", "OEBPS//text/c1.xhtml", NULL,
+	};
+	FILE* f;
+	long size;
+	char* bytes;
+
+	if (mkdtemp(tmp) == NULL) {
+		fprintf(stderr, "Could not make a temporary directory\n");
+		return 1;
+	}
+
+	/* Named after the temporary directory, so no run can find another's */
+	snprintf(abs, sizeof(abs), "/%s", strrchr(tmp, '/') + 1);
+	snprintf(absfile, sizeof(absfile), "%%%s/abs.txt", abs + 1);
+	snprintf(epub, sizeof(epub), "%s/book.epub", tmp);
+	snprintf(out, sizeof(out), "%s/a/out/", tmp);
+
+	memset(&zip, 0, sizeof(zip));
+
+	if (!mz_zip_writer_init_file(&zip, epub, 0)) {
+		fprintf(stderr, "Could not write %s\n", epub);
+		return 1;
+	}
+
+	for (int i = 0; names[i] != NULL; i++) {
+		mz_zip_writer_add_mem(&zip, names[i], "x", 1, MZ_DEFAULT_LEVEL);
+	}
+
+	mz_zip_writer_add_mem(&zip, absfile, "x", 1, MZ_DEFAULT_LEVEL);
+
+	if (!mz_zip_writer_finalize_archive(&zip) || !mz_zip_writer_end(&zip)) {
+		fprintf(stderr, "Could not write %s\n", epub);
+		return 1;
+	}
+
+	/* The names are the only place '%' is found in the archive */
+	if ((f = fopen(epub, "r+")) == NULL || fseek(f, 0, SEEK_END) == -1
+		|| (size = ftell(f)) == -1 || (bytes = malloc(size)) == NULL
+		|| fseek(f, 0, SEEK_SET) == -1
+		|| fread(bytes, 1, size, f) != (size_t) size) {
+		fprintf(stderr, "Could not read %s\n", epub);
+		return 1;
+	}
+
+	for (long i = 0; i < size; i++) {
+		bytes[i] = bytes[i] == '%' ? '/' : bytes[i];
+	}
+
+	for (char* p = absfile; *p != '\0'; p++) {
+		*p = *p == '%' ? '/' : *p;
+	}
+
+	if (fseek(f, 0, SEEK_SET) == -1 || fwrite(bytes, 1, size, f)
+		!= (size_t) size || fclose(f) != 0) {
+		fprintf(stderr, "Could not write %s\n", epub);
+		return 1;
+	}
+
+	free(bytes);
+
+	for (int threads = 1; threads <= 4; threads += 3) {
+
+		uz_unzip_epub(epub, out, NULL, NULL, NULL, threads, 0);
+
+		_expect(out, "mimetype", 1);
+		_expect(out, "double/lead.txt", 1);
+		_expect(out, "OEBPS/text/c1.xhtml", 1);
+		_expect(out, absfile + 1, 1);
+
+		_expect(tmp, "/a/climbed.txt", 0);
+		_expect(tmp, "/a/climbed2.txt", 0);
+		_expect(NULL, abs, 0);
+
+		uz_rm_tree(out);
+
+	}
+
+	/* Only there if extracting went wrong, then it is in the way of no one */
+	rmdir(abs);
+
+	uz_rm_tree(tmp);
+
+	if (failures > 0) {
+		fprintf(stderr, "extract: %d failures\n", failures);
+		return 1;
+	}
+
+	printf("extract: every file stayed in the extract directory\n");
+
+	return 0;
+
+}
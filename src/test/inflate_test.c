@@ -0,0 +1,405 @@
+/*
+ * Differential test of inflate.c against miniz's tinfl. Data of several kinds
+ * is deflated by tdefl into stored, fixed and dynamic blocks, then inflated by
+ * every kernel this CPU can run and by tinfl. Both have to give back the same
+ * bytes, and agree on which truncated and corrupted streams are refused.
+ *
+ * tinfl takes some streams RFC 1951 does not allow, such as ones with the
+ * reserved length and distance codes or with code lengths that do not make up
+ * a whole code. inflate.c refuses them as zlib does, so it may refuse a
+ * damaged stream tinfl took, which is counted but not a failure. It must
+ * never take one tinfl refused.
+ *
+ * inflate.c is included whole so that each kernel is tested on its own,
+ * whatever inf_inflate would pick.
+ */
+#include <stdio.h>
+
+#include "../inflate.c"
+#include "../miniz.h"
+
+/* Most bytes any stream may inflate to here, corrupted ones included */
+#define OUT_MAX (4 * 1024 * 1024)
+
+typedef int (*kernel_t)(struct inf_stream*, uint8_t*, size_t*, size_t);
+
+struct kernel {
+	char* name;
+	kernel_t func;
+};
+
+static struct kernel kernels[2];
+static int kernelnum;
+
+static int failures;
+/* Damaged streams tinfl took but the kernels refused, see above */
+static int stricter;
+
+/* xorshift64, so every run tests the same data */
+static uint64_t seed = 88172645463325252u;
+
+static uint64_t
+_random(void) {
+
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+
+	return seed;
+
+}
+
+static void
+_fail(char* what, char* kind, char* mode, char* kernel) {
+
+	fprintf(stderr, "FAIL: %s (%s data, %s blocks, %s kernel)\n", what, kind,
+		mode, kernel);
+	failures++;
+
+}
+
+/*
+ * Inflates in with kernel through an output buffer of bufsize bytes past the
+ * window, emptying it into *out as the API asks whenever it fills up. Returns
+ * the bytes inflated, or -1 if the stream was refused or inflates past
+ * OUT_MAX.
+ */
+static long
+_inflate_with(kernel_t kernel, uint8_t* in, size_t size, size_t bufsize,
+              uint8_t* out) {
+
+	struct inf_stream* s;
+	uint8_t* buf;
+	size_t bufpos = 0, total = 0, keep;
+	int rtrn;
+
+	if ((s = inf_open(in, size)) == NULL
+		|| (buf = malloc(INF_WINDOW + bufsize)) == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		exit(1);
+	}
+
+	for (;;) {
+
+		size_t from = bufpos;
+
+		rtrn = kernel(s, buf, &bufpos, INF_WINDOW + bufsize);
+
+		if (rtrn == INF_ERROR || total + bufpos - from > OUT_MAX) {
+			rtrn = INF_ERROR;
+			break;
+		}
+
+		memcpy(out + total, buf + from, bufpos - from);
+		total += bufpos - from;
+
+		if (rtrn == INF_DONE) {
+			break;
+		}
+
+		keep = bufpos < INF_WINDOW ? bufpos : INF_WINDOW;
+		memmove(buf, buf + bufpos - keep, keep);
+		bufpos = keep;
+
+	}
+
+	inf_close(s);
+	free(buf);
+
+	return rtrn == INF_DONE ? (long) total : -1;
+
+}
+
+/*
+ * Inflates in with tinfl and every kernel, through a small and a large output
+ * buffer, and checks they all agree. If expect is not NULL, the stream is
+ * valid and has to inflate to its expectlen bytes.
+ */
+static void
+_compare(uint8_t* in, size_t size, uint8_t* expect, size_t expectlen,
+         char* kind, char* mode) {
+
+	static uint8_t* want;
+	static uint8_t* got;
+	size_t wantlen;
+	long gotlen;
+	size_t bufsizes[] = { 1000, 256 * 1024 };
+
+	if (want == NULL && ((want = malloc(OUT_MAX)) == NULL
+		|| (got = malloc(OUT_MAX)) == NULL)) {
+		fprintf(stderr, "Could not allocate memory\n");
+		exit(1);
+	}
+
+	wantlen = tinfl_decompress_mem_to_mem(want, OUT_MAX, in, size, 0);
+
+	if (expect != NULL && (wantlen != expectlen
+		|| memcmp(want, expect, expectlen) != 0)) {
+		_fail("tinfl did not inflate what was deflated", kind, mode, "no");
+		return;
+	}
+
+	for (int k = 0; k < kernelnum; k++) {
+		for (size_t b = 0; b < sizeof(bufsizes) / sizeof(size_t); b++) {
+
+			gotlen = _inflate_with(kernels[k].func, in, size, bufsizes[b],
+				got);
+
+			if (wantlen == TINFL_DECOMPRESS_MEM_TO_MEM_FAILED) {
+				if (gotlen != -1) {
+					_fail("accepted a stream tinfl refused", kind, mode,
+						kernels[k].name);
+				}
+			} else if (gotlen == -1 && expect != NULL) {
+				_fail("refused a stream tinfl accepted", kind, mode,
+					kernels[k].name);
+			} else if (gotlen == -1) {
+				stricter++;
+			} else if ((size_t) gotlen != wantlen
+				|| memcmp(got, want, wantlen) != 0) {
+				_fail("inflated something other than tinfl", kind, mode,
+					kernels[k].name);
+			}
+
+		}
+	}
+
+}
+
+/* Mostly incompressible, so tdefl keeps much of it in stored blocks */
+static void
+_make_random(uint8_t* buf, size_t len) {
+
+	for (size_t i = 0; i < len; i++) {
+		buf[i] = _random();
+	}
+
+}
+
+/* Long runs of a single byte, for matches a distance of 1 back */
+static void
+_make_runs(uint8_t* buf, size_t len) {
+
+	size_t i = 0;
+
+	while (i < len) {
+		size_t run = 1 + _random() % 1000;
+		uint8_t c = _random() % 4;
+		while (run-- > 0 && i < len) {
+			buf[i++] = c;
+		}
+	}
+
+}
+
+/* Words and markup, as a chapter would have */
+static void
+_make_text(uint8_t* buf, size_t len) {
+
+	static char* words[] = {
+		"the ", "of ", "and ", "<p>", "</p>\n", "chapter ", "said ",
+		"<span class=\"italic\">", "</span>", "whale ", "Ishmael, ",
+		"&amp; ", "\xe2\x80\x94", "sea. ", "<a href=\"#note12\">", "</a>",
+	};
+	size_t i = 0;
+
+	while (i < len) {
+		char* word = words[_random() % (sizeof(words) / sizeof(char*))];
+		for (; *word != '\0' && i < len; word++) {
+			buf[i++] = *word;
+		}
+		if (_random() % 50 == 0 && i < len) {
+			buf[i++] = '0' + _random() % 10;
+		}
+	}
+
+}
+
+/* Copies from far back, so matches reach to the edge of the window */
+static void
+_make_far(uint8_t* buf, size_t len) {
+
+	size_t i;
+
+	for (i = 0; i < len && i < 40000; i++) {
+		buf[i] = _random() % 64;
+	}
+
+	while (i < len) {
+		size_t from = i - 32768 + _random() % 8;
+		size_t run = 3 + _random() % 256;
+		while (run-- > 0 && i < len) {
+			buf[i] = buf[from++];
+			i++;
+		}
+		if (i < len) {
+			buf[i++] = _random();
+		}
+	}
+
+}
+
+/*
+ * Cuts the stream short at every length if it is small, at random ones
+ * otherwise, and flips random bits of it. Whether the result is valid is up to
+ * tinfl.
+ */
+static void
+_damage(uint8_t* comp, size_t complen, char* kind, char* mode) {
+
+	uint8_t* copy;
+	int tries = complen < 200 ? (int) complen : 200;
+
+	if ((copy = malloc(complen + 1)) == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		exit(1);
+	}
+
+	for (int t = 0; t < tries; t++) {
+		size_t cut = complen < 200 ? (size_t) t : _random() % complen;
+		memcpy(copy, comp, cut);
+		_compare(copy, cut, NULL, 0, kind, mode);
+	}
+
+	for (int t = 0; t < 200 && complen > 0; t++) {
+		memcpy(copy, comp, complen);
+		for (int flips = 1 + _random() % 3; flips > 0; flips--) {
+			/* The headers at the start are the most interesting to break */
+			size_t at = t % 2 ? _random() % complen
+				: _random() % (complen < 64 ? complen : 64);
+			copy[at] ^= 1 << (_random() % 8);
+		}
+		_compare(copy, complen, NULL, 0, kind, mode);
+	}
+
+	free(copy);
+
+}
+
+static void
+_test_data(char* kind, void (*make)(uint8_t*, size_t), size_t len) {
+
+	struct {
+		char* name;
+		int flags;
+	} modes[] = {
+		{ "stored", TDEFL_FORCE_ALL_RAW_BLOCKS | 128 },
+		{ "fixed", TDEFL_FORCE_ALL_STATIC_BLOCKS | 128 },
+		{ "fixed, greedy", TDEFL_FORCE_ALL_STATIC_BLOCKS
+			| TDEFL_GREEDY_PARSING_FLAG | 16 },
+		{ "dynamic, fast", 1 | TDEFL_GREEDY_PARSING_FLAG },
+		{ "dynamic", 128 },
+		{ "dynamic, best", 4095 },
+		{ "dynamic, rle", TDEFL_RLE_MATCHES | 128 },
+	};
+	uint8_t* data;
+	uint8_t* comp;
+	size_t complen;
+
+	if ((data = malloc(len + 1)) == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		exit(1);
+	}
+
+	make(data, len);
+
+	for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+
+		comp = tdefl_compress_mem_to_heap(data, len, &complen,
+			modes[m].flags);
+
+		if (comp == NULL) {
+			fprintf(stderr, "Could not deflate test data\n");
+			exit(1);
+		}
+
+		_compare(comp, complen, data, len, kind, modes[m].name);
+
+		/* Damaging large streams a couple hundred times adds little */
+		if (len <= 65536) {
+			_damage(comp, complen, kind, modes[m].name);
+		}
+
+		mz_free(comp);
+
+	}
+
+	free(data);
+
+}
+
+/* Streams tdefl would never make, each either refused or valid as given */
+static void
+_test_handmade(void) {
+
+	struct {
+		char* name;
+		uint8_t bytes[16];
+		size_t len;
+	} streams[] = {
+		/* Empty final fixed block */
+		{ "empty fixed", { 0x03, 0x00 }, 2 },
+		/* Empty final stored block, and one whose NLEN does not match */
+		{ "empty stored", { 0x01, 0x00, 0x00, 0xff, 0xff }, 5 },
+		{ "bad NLEN", { 0x01, 0x00, 0x00, 0xff, 0xfe }, 5 },
+		/* Stored block claiming more bytes than there are */
+		{ "short stored", { 0x01, 0x05, 0x00, 0xfa, 0xff, 'a', 'b' }, 7 },
+		/* Reserved block type */
+		{ "type 3", { 0x07, 0x00 }, 2 },
+		/* Fixed block whose first symbol is a match, with nothing to copy */
+		{ "match first", { 0x03, 0x02, 0x00 }, 3 },
+		/* Non-final empty stored block followed by nothing */
+		{ "no final", { 0x00, 0x00, 0x00, 0xff, 0xff }, 5 },
+		/* Fixed block with literal 'a' then a distance code of 30 */
+		{ "distance 30", { 0x4b, 0x04, 0x02, 0x1f, 0x00 }, 5 },
+	};
+
+	for (size_t i = 0; i < sizeof(streams) / sizeof(streams[0]); i++) {
+		_compare(streams[i].bytes, streams[i].len, NULL, 0, streams[i].name,
+			"handmade");
+	}
+
+}
+
+int
+main(void) {
+
+	size_t lens[] = { 0, 1, 2, 3, 258, 259, 4096, 32768, 32769, 65536,
+		300000 };
+	struct {
+		char* name;
+		void (*make)(uint8_t*, size_t);
+	} kinds[] = {
+		{ "random", _make_random },
+		{ "runs", _make_runs },
+		{ "text", _make_text },
+		{ "far", _make_far },
+	};
+
+	kernels[kernelnum++] = (struct kernel) { "base", _inflate_base };
+#ifdef HAVE_BMI2_KERNEL
+	if (__builtin_cpu_supports("bmi2")) {
+		kernels[kernelnum++] = (struct kernel) { "bmi2", _inflate_bmi2 };
+	}
+#endif
+
+	_test_handmade();
+
+	for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+		for (size_t l = 0; l < sizeof(lens) / sizeof(size_t); l++) {
+			_test_data(kinds[k].name, kinds[k].make, lens[l]);
+		}
+		_test_data(kinds[k].name, kinds[k].make, 3 * 1024 * 1024);
+	}
+
+	if (failures > 0) {
+		fprintf(stderr, "inflate: %d failures\n", failures);
+		return 1;
+	}
+
+	printf("inflate: all streams inflated as tinfl does on %d kernels, %d "
+		"damaged streams only tinfl took\n", kernelnum, stricter);
+
+	return 0;
+
+}
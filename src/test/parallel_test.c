@@ -0,0 +1,200 @@
+/*
+ * Checks that inf_inflate_parallel gives back exactly what tinfl inflates on
+ * one thread, for data compressed to just under and just over the size where
+ * it is split up, and far over it, on several thread counts. An output buffer
+ * a byte shorter or longer than the data inflates to has to be refused.
+ *
+ * Only dynamic blocks are looked for to split at, so stored and fixed blocks
+ * test falling back to one thread, as does data under the size.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../inflate.h"
+#include "../miniz.h"
+
+/* Where unzip.c starts handing entries to inf_inflate_parallel */
+#define SPLIT_MIN (2 * INF_CHUNK_MIN)
+
+static int failures;
+
+/* xorshift64, so every run tests the same data */
+static uint64_t seed = 2463534242u;
+
+static uint64_t
+_random(void) {
+
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+
+	return seed;
+
+}
+
+/* Words and markup, deflating to about a third of their size */
+static void
+_make_text(uint8_t* buf, size_t len) {
+
+	size_t i = 0;
+
+	while (i < len) {
+		if (_random() % 8 == 0) {
+			buf[i++] = "<p/>\n"[_random() % 5];
+		} else {
+			buf[i++] = 'a' + _random() % 26;
+		}
+	}
+
+}
+
+/* Incompressible, tdefl keeps it in stored blocks */
+static void
+_make_random(uint8_t* buf, size_t len) {
+
+	for (size_t i = 0; i < len; i++) {
+		buf[i] = _random();
+	}
+
+}
+
+/*
+ * Makes data of kind that deflates with flags to about target bytes, and
+ * deflates it. Returns the deflated data, its size and the data itself.
+ */
+static uint8_t*
+_make_stream(void (*make)(uint8_t*, size_t), int flags, size_t target,
+             uint8_t** data, size_t* datalen, size_t* complen) {
+
+	uint8_t* comp = NULL;
+	size_t len = target;
+
+	/* The ratio barely changes with size, so a few rounds close in on it */
+	for (int round = 0; round < 3; round++) {
+
+		if (round > 0) {
+			mz_free(comp);
+			len = (double) len * target / *complen;
+		}
+
+		if ((*data = realloc(round == 0 ? NULL : *data, len)) == NULL) {
+			fprintf(stderr, "Could not allocate memory\n");
+			exit(1);
+		}
+
+		seed = 2463534242u;
+		make(*data, len);
+
+		if ((comp = tdefl_compress_mem_to_heap(*data, len, complen, flags))
+			== NULL) {
+			fprintf(stderr, "Could not deflate test data\n");
+			exit(1);
+		}
+
+	}
+
+	*datalen = len;
+
+	return comp;
+
+}
+
+static void
+_test_stream(char* name, void (*make)(uint8_t*, size_t), int flags,
+             size_t target) {
+
+	int threads[] = { 1, 2, 3, 4, 8, 16 };
+	uint8_t* data = NULL;
+	uint8_t* comp;
+	uint8_t* want;
+	uint8_t* got;
+	size_t datalen, complen, wantlen;
+
+	comp = _make_stream(make, flags, target, &data, &datalen, &complen);
+
+	/* Landing on the wrong side of SPLIT_MIN would not test what it says */
+	if ((target < SPLIT_MIN) != (complen < SPLIT_MIN)) {
+		fprintf(stderr, "Could not make %s data deflating to %zu bytes\n", name,
+			target);
+		exit(1);
+	}
+
+	if ((want = malloc(datalen + 1)) == NULL
+		|| (got = malloc(datalen + 1)) == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		exit(1);
+	}
+
+	wantlen = tinfl_decompress_mem_to_mem(want, datalen + 1, comp, complen,
+		0);
+
+	if (wantlen == TINFL_DECOMPRESS_MEM_TO_MEM_FAILED) {
+		fprintf(stderr, "FAIL: tinfl could not inflate %s data\n", name);
+		failures++;
+		goto end;
+	}
+
+	for (size_t t = 0; t < sizeof(threads) / sizeof(int); t++) {
+
+		memset(got, 0, wantlen + 1);
+
+		if (inf_inflate_parallel(comp, complen, got, wantlen, threads[t])
+			!= INF_DONE || memcmp(got, want, wantlen) != 0) {
+			fprintf(stderr, "FAIL: %s data, %zu bytes deflated, %d threads: "
+				"not what tinfl inflated\n", name, complen, threads[t]);
+			failures++;
+		}
+
+		if (wantlen > 0 && inf_inflate_parallel(comp, complen, got,
+			wantlen - 1, threads[t]) != INF_ERROR) {
+			fprintf(stderr, "FAIL: %s data, %zu bytes deflated, %d threads: "
+				"took an output a byte short\n", name, complen, threads[t]);
+			failures++;
+		}
+
+		if (inf_inflate_parallel(comp, complen, got, wantlen + 1, threads[t])
+			!= INF_ERROR) {
+			fprintf(stderr, "FAIL: %s data, %zu bytes deflated, %d threads: "
+				"took an output a byte long\n", name, complen, threads[t]);
+			failures++;
+		}
+
+	}
+
+end:
+	mz_free(comp);
+	free(data);
+	free(want);
+	free(got);
+
+}
+
+int
+main(void) {
+
+	size_t targets[] = {
+		SPLIT_MIN - 4096, SPLIT_MIN + 4096, 3 * SPLIT_MIN + 12345,
+		6 * SPLIT_MIN,
+	};
+
+	for (size_t i = 0; i < sizeof(targets) / sizeof(size_t); i++) {
+		_test_stream("text, dynamic", _make_text, 1, targets[i]);
+		_test_stream("text, fixed", _make_text,
+			TDEFL_FORCE_ALL_STATIC_BLOCKS | 1, targets[i]);
+		_test_stream("random, stored", _make_random,
+			TDEFL_FORCE_ALL_RAW_BLOCKS, targets[i]);
+	}
+
+	if (failures > 0) {
+		fprintf(stderr, "parallel: %d failures\n", failures);
+		return 1;
+	}
+
+	printf("parallel: all streams inflated as tinfl does on every thread "
+		"count\n");
+
+	return 0;
+
+}
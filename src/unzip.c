@@ -1,35 +1,347 @@
 /*
  * Procedures for unzipping epub zip archives using miniz.
  */
+#include <ctype.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <fts.h>
+#include <fnmatch.h>
+#include <pthread.h>
 
 #include "miniz.h"
+#include "arena.h"
+#include "sha256.h"
+#include "inflate.h"
+#include "writer.h"
 #include "unzip.h"
 
 #define PATHMAX 4095
 
+/* STORED entries are extracted without copying them through user space */
+#if defined(__linux__) || defined(__FreeBSD__)
+#define HAVE_COPY_FILE_RANGE
+#endif
+
+/* miniz only needs to parse the central directory, we keep our own index. */
+#define READER_FLAGS MZ_ZIP_FLAG_DO_NOT_SORT_CENTRAL_DIRECTORY
+
 /* Magic bits used by zip archives. */
 static uint8_t epub_magic[] = { 0x50, 0x4B, 0x03, 0x04 };
 
+/* Local file header layout, see the zip APPNOTE. */
+#define LDH_SIZE         30
+#define LDH_FLAGS        6
+#define LDH_METHOD       8
+#define LDH_TIME         10
+#define LDH_DATE         12
+#define LDH_CRC32        14
+#define LDH_COMP_SIZE    18
+#define LDH_UNCOMP_SIZE  22
+#define LDH_FILENAME_LEN 26
+#define LDH_EXTRA_LEN    28
+
+/* General purpose flags of a local file header */
+#define FLAG_ENCRYPTED  0x1
+#define FLAG_DESCRIPTOR 0x8
+
+/*
+ * Signatures that can follow an entry's data. The data descriptor's is
+ * optional, the rest end the entries of an archive.
+ */
+#define SIG_DESCRIPTOR  0x08074B50
+#define SIG_CENTRAL_DIR 0x02014B50
+#define SIG_END         0x06054B50
+
+/* Bytes read off a stream at once, see uz_open_stream */
+#define STREAM_BUF (64 * 1024)
+
+/* An epub being read off a stream, one entry after the other. */
+struct uz_stream {
+	int fd;
+	/* Bytes read ahead of the entry being read, from pos up to len */
+	uint8_t buf[STREAM_BUF];
+	size_t pos;
+	size_t len;
+	/* Bytes read off fd so far */
+	uint64_t total;
+	/* Set once past the last entry */
+	int done;
+};
+
+/* Entry read off a stream, as miniz would have found it in the central dir */
+struct uz_entry {
+	mz_zip_archive_file_stat stat;
+	/* Compressed data, NULL once dropped with uz_drop_entry */
+	uint8_t* data;
+};
+
+/*
+ * The archive is mapped into memory once and handed to miniz, so reading the
+ * central directory and entries needs no further read/seek syscalls.
+ */
+struct uz_epub {
+	mz_zip_archive zip;
+	int fd;
+	uint8_t* map;
+	size_t mapsize;
+	int filenum;
+	/* Name of each entry, all stored in namepool. */
+	char** names;
+	char* namepool;
+	/*
+	 * Hash index of entry names, built once when the epub is opened. Each
+	 * slot holds an entry index, or -1 if empty. slotnum is a power of 2.
+	 */
+	int* slots;
+	size_t slotnum;
+	/* Flags given to uz_open_epub */
+	int flags;
+	/* Threads a single large entry may be inflated on */
+	int threads;
+	/*
+	 * Set when the epub is read off a stream instead, there is no mapping and
+	 * no central directory then. Entries are kept in entries as they are read,
+	 * entrycap of them fit.
+	 */
+	struct uz_stream* stream;
+	struct uz_entry** entries;
+	int entrycap;
+	/*
+	 * Set when the epub is an unpacked directory, which fd is then open on.
+	 * Its files are added to entries as they are looked up, see _locate_file.
+	 */
+	int dir;
+	/*
+	 * Caps set with uz_set_budget. spent is what entries inflated to so far,
+	 * overspent is set once any cap was gone over. Both are shared by every
+	 * thread extracting, under budget_lock.
+	 */
+	struct uz_budget budget;
+	uint64_t spent;
+	int overspent;
+	pthread_mutex_t budget_lock;
+	/*
+	 * Set when the central directory could not be read, or entries had to be
+	 * skipped while recovering them from local headers, see _recover.
+	 */
+	int damaged;
+	/*
+	 * Where miniz keeps the central directory and the index of its names,
+	 * freed all at once on close. NULL for streams and unpacked epubs.
+	 */
+	struct arena* arena;
+};
+
+/* Case-insensitive FNV-1a, entry names are matched the way miniz did. */
+static uint32_t
+_hash_name(char* name) {
+
+	uint32_t hash = 2166136261u;
+
+	for (unsigned char* p = (unsigned char*) name; *p != '\0'; p++) {
+		hash ^= tolower(*p);
+		hash *= 16777619u;
+	}
+
+	return hash;
+
+}
+
+/* Adds entry i, whose name is already in names, to the hash index. */
+static void
+_index_name(struct uz_epub* uz, int i) {
+
+	size_t slot = _hash_name(uz->names[i]) & (uz->slotnum - 1);
+
+	while (uz->slots[slot] != -1) {
+		slot = (slot + 1) & (uz->slotnum - 1);
+	}
+
+	uz->slots[slot] = i;
+
+}
+
+/* Chunks an epub's arena takes from malloc as it grows */
+#define ARENA_CHUNK (256 * 1024)
+
+/*
+ * Each thread keeps the arena of the last epub it closed for the next one it
+ * opens, so reading books one after another allocates nothing new once the
+ * first one is open, and threads never contend over it.
+ */
+static pthread_key_t spare_arena;
+static pthread_once_t spare_once = PTHREAD_ONCE_INIT;
+static int spare_ok;
+
+static void
+_free_arena(void* arena) {
+
+	arena_free(arena);
+
+}
+
+static void
+_make_spare_key(void) {
+
+	spare_ok = pthread_key_create(&spare_arena, _free_arena) == 0;
+
+}
+
+static struct arena*
+_take_arena(void) {
+
+	struct arena* arena;
+
+	pthread_once(&spare_once, _make_spare_key);
+
+	if (spare_ok && (arena = pthread_getspecific(spare_arena)) != NULL) {
+		pthread_setspecific(spare_arena, NULL);
+		return arena;
+	}
+
+	return arena_new(ARENA_CHUNK);
+
+}
+
+/* Resets arena, in one go, and keeps it for the thread's next epub */
+static void
+_give_arena(struct arena* arena) {
+
+	arena_reset(arena);
+
+	if (spare_ok && pthread_getspecific(spare_arena) == NULL
+		&& pthread_setspecific(spare_arena, arena) == 0) {
+		return;
+	}
+
+	arena_free(arena);
+
+}
+
+/* miniz's allocation callbacks, opaque is the epub's arena */
+static void*
+_mz_alloc(void* opaque, size_t items, size_t size) {
+
+	if (size != 0 && items > SIZE_MAX / size) {
+		return NULL;
+	}
+
+	return arena_alloc(opaque, items * size);
+
+}
+
+static void
+_mz_free(void* opaque, void* address) {
+
+	arena_release(opaque, address);
+
+}
+
+static void*
+_mz_realloc(void* opaque, void* address, size_t items, size_t size) {
+
+	if (size != 0 && items > SIZE_MAX / size) {
+		return NULL;
+	}
+
+	return arena_realloc(opaque, address, items * size);
+
+}
+
+/*
+ * Copies every entry name out of the central directory and indexes them, so
+ * looking an entry up never has to search or sort the central directory.
+ */
 static int
-_is_epub(char* filename) {
+_index_entries(struct uz_epub* uz) {
 
-	FILE* file;
-	uint8_t magic[4];
+	size_t poolsize = 0;
+	char* p;
+
+	uz->filenum = mz_zip_reader_get_num_files(&uz->zip);
+
+	for (int i = 0; i < uz->filenum; i++) {
+		poolsize += mz_zip_reader_get_filename(&uz->zip, i, NULL, 0);
+	}
+
+	/* Keep the index at most half full */
+	for (uz->slotnum = 16; uz->slotnum < (size_t) uz->filenum * 2;) {
+		uz->slotnum *= 2;
+	}
+
+	uz->names = arena_alloc(uz->arena, sizeof(char*) * (uz->filenum + 1));
+	uz->namepool = arena_alloc(uz->arena, poolsize + 1);
+	uz->slots = arena_alloc(uz->arena, sizeof(int) * uz->slotnum);
+
+	if (uz->names == NULL || uz->namepool == NULL || uz->slots == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		return -1;
+	}
+
+	memset(uz->slots, -1, sizeof(int) * uz->slotnum);
+
+	p = uz->namepool;
+
+	for (int i = 0; i < uz->filenum; i++) {
+		uz->names[i] = p;
+		p += mz_zip_reader_get_filename(&uz->zip, i, p,
+			poolsize - (p - uz->namepool) + 1);
+		_index_name(uz, i);
+	}
+
+	return 0;
+
+}
+
+/*
+ * Gets the stat of the entry at index, out of the central directory or out of
+ * what was read off the stream. Returns -1 if there is no such entry.
+ */
+static int
+_entry_stat(struct uz_epub* uz, int index, mz_zip_archive_file_stat* stat) {
+
+	if (uz->stream == NULL && !uz->dir) {
+		return mz_zip_reader_file_stat(&uz->zip, index, stat) ? 0 : -1;
+	}
+
+	if (index < 0 || index >= uz->filenum) {
+		return -1;
+	}
+
+	*stat = uz->entries[index]->stat;
+
+	return 0;
+
+}
+
+static int
+_is_directory(struct uz_epub* uz, int index) {
+
+	if (uz->stream != NULL || uz->dir) {
+		return uz->entries[index]->stat.m_is_directory;
+	}
+
+	return mz_zip_reader_is_file_a_directory(&uz->zip, index);
 
-	file = fopen(filename, "r");
+}
 
-	fread(magic, sizeof(uint8_t), sizeof(magic), file);
+static int
+_is_epub(uint8_t* map, size_t mapsize) {
 
-	fclose(file);
+	if (mapsize < sizeof(epub_magic)) {
+		return 0;
+	}
 
-	if (memcmp(magic, epub_magic, sizeof(magic)) == 0) {
+	if (memcmp(map, epub_magic, sizeof(epub_magic)) == 0) {
 		return 1;
 	}
 
@@ -38,122 +350,3117 @@ _is_epub(char* filename) {
 }
 
 /*
- * uz_rm_tree does not check whether we have permission to delete a file as it
- * will only be used to delete files that ebread itself created.
+ * Maps the file epub into memory, returns the mapping or NULL on failure. The
+ * file stays open in fd, STORED entries are mapped on their own from it.
  */
-void
-uz_rm_tree(char* path) {
+static uint8_t*
+_map_epub(char* epub, int* fd, size_t* mapsize) {
 
-	char* pargv[] = { path, NULL };
-	FTS* fts;
-	FTSENT* cur;
+	struct stat st;
+	void* map;
 
-	fts = fts_open(pargv, FTS_NOSTAT, NULL);
+	if ((*fd = open(epub, O_RDONLY)) == -1) {
+		fprintf(stderr, "%s: Could not open\n", epub);
+		return NULL;
+	}
 
-	while ((cur = fts_read(fts)) != NULL) {
+	if (fstat(*fd, &st) == -1 || st.st_size == 0) {
+		fprintf(stderr, "%s: Not an epub.\n", epub);
+		close(*fd);
+		return NULL;
+	}
 
-		switch (cur->fts_info) {
-		case FTS_DP:
-		case FTS_DNR:
-			rmdir(cur->fts_accpath);
-			break;
-		default:
-			unlink(cur->fts_accpath);
-			break;
-		}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, *fd, 0);
 
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "%s: Could not map into memory\n", epub);
+		close(*fd);
+		return NULL;
 	}
 
-	fts_close(fts);
+	/* Entries are mostly read front to back, let the kernel read ahead. */
+	posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+	*mapsize = st.st_size;
+
+	return map;
 
 }
 
-int
-uz_make_path(char* path) {
+/*
+ * Returns a pointer to an entry's data in the mapping, found through its local
+ * header, or NULL if the entry's data would lie outside of the archive. Entries
+ * read off a stream have their data on the heap, NULL if it was dropped.
+ */
+static uint8_t*
+_entry_data(struct uz_epub* uz, mz_zip_archive_file_stat* stat) {
 
-	char* slash;
-	char* end;
+	uint8_t* ldh;
+	uint64_t data_ofs;
 
-	slash = path;
-	end = strchr(path, '\0');
+	if (uz->stream != NULL) {
+		return uz->entries[stat->m_file_index]->data;
+	}
 
-	for (;;) {
+	if (stat->m_local_header_ofs + LDH_SIZE > uz->mapsize) {
+		return NULL;
+	}
 
-		slash += strspn(slash, "/");
-		slash += strcspn(slash, "/");
+	ldh = uz->map + stat->m_local_header_ofs;
 
-		*slash = '\0';
+	if (memcmp(ldh, epub_magic, sizeof(epub_magic)) != 0) {
+		return NULL;
+	}
 
-	/* EEXIST means the directory already exists, which is to be expected. */
-		if (mkdir(path, 0777) == -1 && errno != EEXIST) {
-			return -1;
-		}
+	data_ofs = stat->m_local_header_ofs + LDH_SIZE
+		+ MZ_READ_LE16(ldh + LDH_FILENAME_LEN)
+		+ MZ_READ_LE16(ldh + LDH_EXTRA_LEN);
 
-		if (slash == end) {
-			break;
-		}
+	if (data_ofs + stat->m_comp_size > uz->mapsize) {
+		return NULL;
+	}
 
-		*slash = '/';
+	return uz->map + data_ofs;
+
+}
+
+/*
+ * STORED entries can be parsed straight out of the page cache. Each one gets
+ * its own private copy-on-write mapping, as the parser writes into what it is
+ * given, and only the pages it writes to end up being copied.
+ */
+static char*
+_map_stored_entry(struct uz_epub* uz, mz_zip_archive_file_stat* stat) {
+
+	uint8_t* data;
+	size_t pagesize, pageofs;
+	uint8_t* map;
+
+	/* There is no file to map entries read off a stream from */
+	if (uz->stream != NULL) {
+		return NULL;
 	}
 
-	return 0;
+	if (stat->m_method != 0 || stat->m_is_encrypted || stat->m_uncomp_size == 0
+		|| stat->m_comp_size != stat->m_uncomp_size) {
+		return NULL;
+	}
+
+	if ((data = _entry_data(uz, stat)) == NULL) {
+		return NULL;
+	}
+
+	if (!(uz->flags & UZ_CHECK_RENDERED)
+		&& mz_crc32(MZ_CRC32_INIT, data, stat->m_uncomp_size) != stat->m_crc32) {
+		return NULL;
+	}
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	pageofs = (data - uz->map) % pagesize;
+
+	map = mmap(NULL, stat->m_uncomp_size + pageofs, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE, uz->fd, (data - uz->map) - pageofs);
+
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	return (char*) map + pageofs;
 
 }
 
-int
-uz_unzip_epub(char* epub, char* output_dir) {
+/*
+ * Maps a file of an unpacked epub the way _map_stored_entry maps an entry, so
+ * it can be written to. Returns NULL if it could not be mapped, or no longer
+ * has the size it was looked up with.
+ */
+static uint8_t*
+_map_file(struct uz_epub* uz, mz_zip_archive_file_stat* stat) {
 
-	mz_zip_archive ep_archive;
-	int filenum;
-	char zip_filename[ZIP_PATH_MAX + 1];
-	char unzipped_path[PATHMAX + 1];
-	char* last_slash;
+	struct stat st;
+	void* map = MAP_FAILED;
+	int fd;
 
-	if (!_is_epub(epub)) {
-		fprintf(stderr, "%s: Not an epub.\n", epub);
+	if ((fd = openat(uz->fd, stat->m_filename, O_RDONLY)) == -1) {
+		return NULL;
+	}
+
+	if (fstat(fd, &st) == 0 && (uint64_t) st.st_size == stat->m_uncomp_size
+		&& st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+			0);
+	}
+
+	close(fd);
+
+	return map == MAP_FAILED ? NULL : map;
+
+}
+
+/*
+ * Room left for a local header's extra field when working out where an entry
+ * ends without reading its header, see _entry_span.
+ */
+#define EXTRA_ROOM 1024
+
+/* Entries less than this far apart are hinted to the kernel as one range */
+#define PREFETCH_GAP (64 * 1024)
+
+/*
+ * Works out which bytes of the archive entry i takes up, without touching any
+ * of them. Returns -1 if the epub is not a mapped archive.
+ */
+static int
+_entry_span(struct uz_epub* uz, int i, uint64_t* ofs, uint64_t* len) {
+
+	mz_zip_archive_file_stat stat;
+
+	if (uz->map == NULL || _entry_stat(uz, i, &stat) == -1) {
 		return -1;
 	}
 
-	mz_zip_zero_struct(&ep_archive);
+	*ofs = stat.m_local_header_ofs;
+	*len = LDH_SIZE + strlen(stat.m_filename) + EXTRA_ROOM + stat.m_comp_size;
 
-	mz_zip_reader_init_file(&ep_archive, epub, 0);
+	return 0;
 
-	filenum = mz_zip_reader_get_num_files(&ep_archive);
+}
 
-	for (int i = 0; i < filenum; i++) {
+/* An entry and where it lies in the archive, see _sort_by_offset */
+struct uz_span {
+	uint64_t ofs;
+	int index;
+};
 
-		memset(unzipped_path, 0, PATHMAX + 1);
+static int
+_compare_spans(const void* a, const void* b) {
 
-		mz_zip_reader_get_filename(&ep_archive, i, zip_filename, ZIP_PATH_MAX);
+	const struct uz_span* x = a;
+	const struct uz_span* y = b;
 
-		strncat(unzipped_path, output_dir, PATHMAX);
-		strncat(unzipped_path, zip_filename, PATHMAX - strlen(unzipped_path));
+	return x->ofs < y->ofs ? -1 : x->ofs > y->ofs;
 
-		/* This should give us the full path of the file's parent directory */
-		last_slash = strrchr(unzipped_path, '/');
-		*last_slash = '\0';
+}
 
-		if (uz_make_path(unzipped_path) == -1) {
+/*
+ * Sorts the n entry indexes by where the entries lie in the archive, so that
+ * reading them in that order reads the archive front to back. Indexes of -1
+ * end up first. Left as they are if the epub is not a mapped archive, or there
+ * is no memory to sort them in, the order only matters to speed.
+ */
+static void
+_sort_by_offset(struct uz_epub* uz, int* indexes, int n) {
 
-			fprintf(stderr, "Error creating extract directory: %s\n",
-				unzipped_path);
+	struct uz_span* spans;
+	uint64_t len;
 
-			mz_zip_reader_end(&ep_archive);
+	if (uz->map == NULL || n < 2
+		|| (spans = malloc(sizeof(struct uz_span) * n)) == NULL) {
+		return;
+	}
 
-			uz_rm_tree(output_dir);
+	for (int i = 0; i < n; i++) {
+		spans[i].index = indexes[i];
+		spans[i].ofs = 0;
+		if (indexes[i] != -1) {
+			_entry_span(uz, indexes[i], &spans[i].ofs, &len);
+		}
+	}
 
-			return -1;
+	qsort(spans, n, sizeof(struct uz_span), _compare_spans);
+
+	for (int i = 0; i < n; i++) {
+		indexes[i] = spans[i].index;
+	}
+
+	free(spans);
+
+}
+
+/*
+ * Asks the kernel to start reading the n entries at indexes, in that order,
+ * while they are not needed yet. Entries next to one another are asked for as
+ * one range, so entries sorted by offset turn into a few long reads.
+ */
+static void
+_prefetch(struct uz_epub* uz, int* indexes, int n) {
+
+	uint64_t start = 0, end = 0, ofs, len;
+
+	for (int i = 0; i < n; i++) {
+
+		if (indexes[i] == -1 || _entry_span(uz, indexes[i], &ofs, &len) == -1) {
+			continue;
+		}
+
+		if (end > 0 && ofs >= start && ofs <= end + PREFETCH_GAP) {
+			end = ofs + len > end ? ofs + len : end;
+			continue;
+		}
+
+		if (end > 0) {
+			posix_fadvise(uz->fd, start, end - start, POSIX_FADV_WILLNEED);
+		}
+
+		start = ofs;
+		end = ofs + len;
+
+	}
+
+	if (end > 0) {
+		posix_fadvise(uz->fd, start, end - start, POSIX_FADV_WILLNEED);
+	}
+
+}
+
+/* Hands the entry's data over in pieces of at most STREAM_CHUNK bytes. */
+#define STREAM_CHUNK TINFL_LZ_DICT_SIZE
+
+static int
+_stream_stored(mz_zip_archive_file_stat* stat, uint8_t* data, int verify,
+               int (*func)(char* buf, size_t len, void* opaque), void* opaque) {
+
+	mz_uint32 crc = MZ_CRC32_INIT;
+	size_t len;
+
+	for (uint64_t ofs = 0; ofs < stat->m_uncomp_size; ofs += len) {
+
+		len = stat->m_uncomp_size - ofs;
+		if (len > STREAM_CHUNK) {
+			len = STREAM_CHUNK;
 		}
 
-		*last_slash = '/';
+		if (verify) {
+			crc = mz_crc32(crc, data + ofs, len);
+		}
 
-		mz_zip_reader_extract_file_to_file(&ep_archive, zip_filename,
-			unzipped_path, 0);
+		if (func((char*) data + ofs, len, opaque) == -1) {
+			return -1;
+		}
 
 	}
 
-	mz_zip_reader_end(&ep_archive);
+	if (verify && crc != stat->m_crc32) {
+		fprintf(stderr, "%s: CRC-32 check failed\n", stat->m_filename);
+		return -1;
+	}
 
 	return 0;
 
 }
+
+/*
+ * tinfl inflates into a wrapping buffer the size of its dictionary, each time
+ * it fills up some of it, that piece is handed over before it gets overwritten.
+ */
+static int
+_stream_deflated(mz_zip_archive_file_stat* stat, uint8_t* data, int verify,
+                 int (*func)(char* buf, size_t len, void* opaque),
+                 void* opaque) {
+
+	tinfl_decompressor* inflator;
+	uint8_t* window;
+	size_t in_ofs = 0, out_ofs = 0;
+	size_t in_size, out_size;
+	uint64_t total = 0;
+	mz_uint32 crc = MZ_CRC32_INIT;
+	tinfl_status status;
+	int rtrn = -1;
+
+	inflator = malloc(sizeof(tinfl_decompressor));
+	window = malloc(TINFL_LZ_DICT_SIZE);
+
+	if (inflator == NULL || window == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		goto end;
+	}
+
+	tinfl_init(inflator);
+
+	do {
+
+		in_size = stat->m_comp_size - in_ofs;
+		out_size = TINFL_LZ_DICT_SIZE - out_ofs;
+
+		status = tinfl_decompress(inflator, data + in_ofs, &in_size, window,
+			window + out_ofs, &out_size, 0);
+
+		in_ofs += in_size;
+		total += out_size;
+
+		/* Never trust more output than the central directory claims. */
+		if (total > stat->m_uncomp_size) {
+			status = TINFL_STATUS_FAILED;
+			break;
+		}
+
+		if (out_size > 0) {
+			if (verify) {
+				crc = mz_crc32(crc, window + out_ofs, out_size);
+			}
+			if (func((char*) window + out_ofs, out_size, opaque) == -1) {
+				goto end;
+			}
+		}
+
+		out_ofs = (out_ofs + out_size) & (TINFL_LZ_DICT_SIZE - 1);
+
+	} while (status == TINFL_STATUS_HAS_MORE_OUTPUT);
+
+	if (status != TINFL_STATUS_DONE || total != stat->m_uncomp_size) {
+		fprintf(stderr, "%s: Could not inflate\n", stat->m_filename);
+	} else if (verify && crc != stat->m_crc32) {
+		fprintf(stderr, "%s: CRC-32 check failed\n", stat->m_filename);
+	} else {
+		rtrn = 0;
+	}
+
+end:
+	free(inflator);
+	free(window);
+
+	return rtrn;
+
+}
+
+/*
+ * inf_inflate fills a buffer of INF_WINDOW bytes of history followed by up to
+ * INFLATE_CHUNK new bytes. Each time it fills up, the new bytes are handed
+ * over and the last INF_WINDOW bytes are moved to the front.
+ */
+#define INFLATE_CHUNK (256 * 1024)
+
+static int
+_stream_inf(mz_zip_archive_file_stat* stat, uint8_t* data, int verify,
+            int (*func)(char* buf, size_t len, void* opaque), void* opaque) {
+
+	struct inf_stream* inf;
+	uint8_t* buf;
+	/*
+	 * Entries that fit are inflated in one go, without any moving. The byte
+	 * to spare is where data longer than claimed shows up.
+	 */
+	size_t bufsize = stat->m_uncomp_size < INF_WINDOW + INFLATE_CHUNK
+		? stat->m_uncomp_size + 1 : INF_WINDOW + INFLATE_CHUNK;
+	size_t start = 0, pos = 0;
+	uint64_t total = 0;
+	mz_uint32 crc = MZ_CRC32_INIT;
+	int status = INF_ERROR, rtrn = -1;
+
+	inf = inf_open(data, stat->m_comp_size);
+	buf = malloc(bufsize);
+
+	if (inf == NULL || buf == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		goto end;
+	}
+
+	for (;;) {
+
+		status = inf_inflate(inf, buf, &pos, bufsize);
+		total += pos - start;
+
+		/* Never trust more output than the central directory claims. */
+		if (status == INF_ERROR || total > stat->m_uncomp_size) {
+			status = INF_ERROR;
+			break;
+		}
+
+		if (verify) {
+			crc = mz_crc32(crc, buf + start, pos - start);
+		}
+
+		if (pos > start && func((char*) buf + start, pos - start, opaque)
+			== -1) {
+			goto end;
+		}
+
+		if (status == INF_DONE) {
+			break;
+		}
+
+		if (pos > INF_WINDOW) {
+			memmove(buf, buf + pos - INF_WINDOW, INF_WINDOW);
+			pos = INF_WINDOW;
+		}
+
+		start = pos;
+
+	}
+
+	if (status != INF_DONE || total != stat->m_uncomp_size) {
+		fprintf(stderr, "%s: Could not inflate\n", stat->m_filename);
+	} else if (verify && crc != stat->m_crc32) {
+		fprintf(stderr, "%s: CRC-32 check failed\n", stat->m_filename);
+	} else {
+		rtrn = 0;
+	}
+
+end:
+	if (inf != NULL) {
+		inf_close(inf);
+	}
+	free(buf);
+
+	return rtrn;
+
+}
+
+/*
+ * Entries compressed to at least this many bytes are inflated on several
+ * threads, if there are any, see inf_inflate_parallel.
+ */
+#define PARALLEL_MIN (2 * INF_CHUNK_MIN)
+
+/*
+ * Inflates the entry's data into buf, which holds its uncompressed size, on up
+ * to threads threads.
+ */
+static int
+_inflate_entry(mz_zip_archive_file_stat* stat, uint8_t* data, char* buf,
+               int threads) {
+
+	struct inf_stream* inf;
+	size_t pos = 0;
+	int status;
+
+	if (!inf_supported()) {
+		return tinfl_decompress_mem_to_mem(buf, stat->m_uncomp_size, data,
+			stat->m_comp_size, 0) == stat->m_uncomp_size ? 0 : -1;
+	}
+
+	if (threads > 1 && stat->m_comp_size >= PARALLEL_MIN) {
+		return inf_inflate_parallel(data, stat->m_comp_size, (uint8_t*) buf,
+			stat->m_uncomp_size, threads) == INF_DONE ? 0 : -1;
+	}
+
+	if ((inf = inf_open(data, stat->m_comp_size)) == NULL) {
+		return -1;
+	}
+
+	status = inf_inflate(inf, (uint8_t*) buf, &pos, stat->m_uncomp_size);
+
+	inf_close(inf);
+
+	return status == INF_DONE && pos == stat->m_uncomp_size ? 0 : -1;
+
+}
+
+/*
+ * Inflates a large entry in full on the epub's threads, then hands it over the
+ * way a STORED one is. Memory use grows with the entry, which is what lets its
+ * pieces be inflated out of order.
+ */
+static int
+_stream_parallel(mz_zip_archive_file_stat* stat, uint8_t* data, int threads,
+                 int verify, int (*func)(char* buf, size_t len, void* opaque),
+                 void* opaque) {
+
+	char* buf;
+	int rtrn;
+
+	if ((buf = malloc(stat->m_uncomp_size)) == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		return -1;
+	}
+
+	if (_inflate_entry(stat, data, buf, threads) == -1) {
+		fprintf(stderr, "%s: Could not inflate\n", stat->m_filename);
+		free(buf);
+		return -1;
+	}
+
+	rtrn = _stream_stored(stat, (uint8_t*) buf, verify, func, opaque);
+
+	free(buf);
+
+	return rtrn;
+
+}
+
+/*
+ * Checks that an entry inflating to size bytes stays within the epub's caps on
+ * single entries. Returns -1 and marks the epub overspent if it does not.
+ */
+static int
+_check_entry_budget(struct uz_epub* uz, mz_zip_archive_file_stat* stat,
+                    uint64_t size) {
+
+	struct uz_budget* budget = &uz->budget;
+	uint64_t comp = stat->m_comp_size > 0 ? stat->m_comp_size : 1;
+
+	if (budget->entry_max != 0 && size > budget->entry_max) {
+		fprintf(stderr, "%s: Inflates to more than %zu bytes\n",
+			stat->m_filename, budget->entry_max);
+	} else if (budget->ratio_max != 0 && size / comp >= budget->ratio_max
+		&& size > budget->ratio_max * comp) {
+		fprintf(stderr, "%s: Inflates to more than %lu times its size\n",
+			stat->m_filename, budget->ratio_max);
+	} else {
+		return 0;
+	}
+
+	pthread_mutex_lock(&uz->budget_lock);
+	uz->overspent = 1;
+	pthread_mutex_unlock(&uz->budget_lock);
+
+	return -1;
+
+}
+
+/*
+ * Charges len more inflated bytes to the epub, or only checks they would fit
+ * if keep is not set. Returns -1 and marks the epub overspent if they do not.
+ */
+static int
+_spend(struct uz_epub* uz, mz_zip_archive_file_stat* stat, uint64_t len,
+       int keep) {
+
+	int rtrn = 0, first = 0;
+
+	if (uz->budget.total_max == 0) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&uz->budget_lock);
+
+	if (uz->spent + len > uz->budget.total_max) {
+		first = !uz->overspent;
+		uz->overspent = 1;
+		rtrn = -1;
+	} else if (keep) {
+		uz->spent += len;
+	}
+
+	pthread_mutex_unlock(&uz->budget_lock);
+
+	/* Other threads running out after the first is no news */
+	if (first) {
+		fprintf(stderr, "%s: Epub inflates to more than %zu bytes\n",
+			stat->m_filename, uz->budget.total_max);
+	}
+
+	return rtrn;
+
+}
+
+static int
+_is_overspent(struct uz_epub* uz) {
+
+	int overspent;
+
+	pthread_mutex_lock(&uz->budget_lock);
+	overspent = uz->overspent;
+	pthread_mutex_unlock(&uz->budget_lock);
+
+	return overspent;
+
+}
+
+/*
+ * Stands in for the func given to _stream_data, charging each piece to the
+ * budget before handing it on. This is what holds the caps when an entry
+ * inflates to other than what its headers claim.
+ */
+struct uz_meter {
+	struct uz_epub* uz;
+	mz_zip_archive_file_stat* stat;
+	uint64_t size;
+	int (*func)(char* buf, size_t len, void* opaque);
+	void* opaque;
+};
+
+static int
+_meter_piece(char* buf, size_t len, void* opaque) {
+
+	struct uz_meter* meter = opaque;
+
+	meter->size += len;
+
+	if (_check_entry_budget(meter->uz, meter->stat, meter->size) == -1
+		|| _spend(meter->uz, meter->stat, len, 1) == -1) {
+		return -1;
+	}
+
+	return meter->func(buf, len, meter->opaque);
+
+}
+
+/*
+ * Streams the entry at index to func, checking its CRC-32 if verify is set.
+ * Large entries are inflated on up to threads threads.
+ */
+static int
+_stream_data(struct uz_epub* uz, int index, int threads, int verify,
+             int (*func)(char* buf, size_t len, void* opaque), void* opaque) {
+
+	mz_zip_archive_file_stat stat;
+	struct uz_meter meter;
+	uint8_t* data;
+	int rtrn;
+
+	if (_entry_stat(uz, index, &stat) == -1) {
+		fprintf(stderr, "Could not read archive entry %d\n", index);
+		return -1;
+	}
+
+	/* Entries claiming too much are refused before anything is inflated */
+	if (_check_entry_budget(uz, &stat, stat.m_uncomp_size) == -1
+		|| _spend(uz, &stat, stat.m_uncomp_size, 0) == -1) {
+		return -1;
+	}
+
+	meter.uz = uz;
+	meter.stat = &stat;
+	meter.size = 0;
+	meter.func = func;
+	meter.opaque = opaque;
+	func = _meter_piece;
+	opaque = &meter;
+
+	/* Files of an unpacked epub have no CRC-32 to check against */
+	if (uz->dir) {
+		if (stat.m_uncomp_size == 0) {
+			return 0;
+		}
+		if ((data = _map_file(uz, &stat)) == NULL) {
+			fprintf(stderr, "%s: Could not read entry\n", stat.m_filename);
+			return -1;
+		}
+		rtrn = _stream_stored(&stat, data, 0, func, opaque);
+		munmap(data, stat.m_uncomp_size);
+		return rtrn;
+	}
+
+	if (stat.m_is_encrypted || (data = _entry_data(uz, &stat)) == NULL
+		|| (stat.m_method == 0 && stat.m_comp_size != stat.m_uncomp_size)) {
+		fprintf(stderr, "%s: Could not read entry\n", stat.m_filename);
+		return -1;
+	}
+
+	switch (stat.m_method) {
+	case 0:
+		return _stream_stored(&stat, data, verify, func, opaque);
+	case MZ_DEFLATED:
+		if (inf_supported() && threads > 1
+			&& stat.m_comp_size >= PARALLEL_MIN) {
+			return _stream_parallel(&stat, data, threads, verify, func,
+				opaque);
+		}
+		if (inf_supported()) {
+			return _stream_inf(&stat, data, verify, func, opaque);
+		}
+		return _stream_deflated(&stat, data, verify, func, opaque);
+	default:
+		fprintf(stderr, "%s: Unsupported compression method\n",
+			stat.m_filename);
+		return -1;
+	}
+
+}
+
+/*
+ * Makes sure at least n bytes are read ahead on the stream, n being at most
+ * STREAM_BUF. Returns how many are, fewer than n only once the stream has
+ * ended, or -1 if it could not be read.
+ */
+static ssize_t
+_stream_peek(struct uz_stream* s, size_t n) {
+
+	ssize_t got;
+
+	if (s->len - s->pos >= n) {
+		return s->len - s->pos;
+	}
+
+	memmove(s->buf, s->buf + s->pos, s->len - s->pos);
+	s->len -= s->pos;
+	s->pos = 0;
+
+	while (s->len < n) {
+
+		if ((got = read(s->fd, s->buf + s->len, STREAM_BUF - s->len)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		if (got == 0) {
+			break;
+		}
+
+		s->len += got;
+		s->total += got;
+
+	}
+
+	return s->len;
+
+}
+
+/* Takes n bytes off the stream into dst, or skips them if dst is NULL. */
+static int
+_stream_take(struct uz_stream* s, uint8_t* dst, size_t n) {
+
+	size_t len;
+
+	while (n > 0) {
+
+		if (_stream_peek(s, 1) <= 0) {
+			return -1;
+		}
+
+		len = s->len - s->pos < n ? s->len - s->pos : n;
+
+		if (dst != NULL) {
+			memcpy(dst, s->buf + s->pos, len);
+			dst += len;
+		}
+
+		s->pos += len;
+		n -= len;
+
+	}
+
+	return 0;
+
+}
+
+/* Local time of an MS-DOS time and date, as miniz reads them */
+static MZ_TIME_T
+_dos_to_time(int dostime, int dosdate) {
+
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_isdst = -1;
+	tm.tm_year = ((dosdate >> 9) & 127) + 1980 - 1900;
+	tm.tm_mon = ((dosdate >> 5) & 15) - 1;
+	tm.tm_mday = dosdate & 31;
+	tm.tm_hour = (dostime >> 11) & 31;
+	tm.tm_min = (dostime >> 5) & 63;
+	tm.tm_sec = (dostime << 1) & 62;
+
+	return mktime(&tm);
+
+}
+
+/* Appends len bytes to a buffer of *size bytes that has room for *cap. */
+static int
+_append(uint8_t** buf, size_t* size, size_t* cap, uint8_t* bytes, size_t len) {
+
+	uint8_t* p;
+	size_t newcap = *cap > 0 ? *cap : STREAM_BUF;
+
+	while (newcap < *size + len) {
+		newcap *= 2;
+	}
+
+	if (newcap != *cap) {
+		if ((p = realloc(*buf, newcap)) == NULL) {
+			return -1;
+		}
+		*buf = p;
+		*cap = newcap;
+	}
+
+	memcpy(*buf + *size, bytes, len);
+	*size += len;
+
+	return 0;
+
+}
+
+/*
+ * Takes deflate data off the stream whose size is only given by the data
+ * descriptor after it. tinfl is run over it into a scratch window, only to
+ * find out where it ends. Returns the data in a heap buffer, NULL if it is not
+ * valid deflate.
+ */
+static uint8_t*
+_take_deflated(struct uz_stream* s, size_t* size) {
+
+	tinfl_decompressor* inflator;
+	uint8_t* window;
+	uint8_t* data = NULL;
+	size_t cap = 0, out_ofs = 0;
+	size_t in_size, out_size;
+	tinfl_status status = TINFL_STATUS_FAILED;
+
+	*size = 0;
+	inflator = malloc(sizeof(tinfl_decompressor));
+	window = malloc(TINFL_LZ_DICT_SIZE);
+
+	if (inflator == NULL || window == NULL) {
+		goto end;
+	}
+
+	tinfl_init(inflator);
+
+	do {
+
+		if (_stream_peek(s, 1) <= 0) {
+			status = TINFL_STATUS_FAILED;
+			break;
+		}
+
+		in_size = s->len - s->pos;
+		out_size = TINFL_LZ_DICT_SIZE - out_ofs;
+
+		status = tinfl_decompress(inflator, s->buf + s->pos, &in_size, window,
+			window + out_ofs, &out_size, TINFL_FLAG_HAS_MORE_INPUT);
+
+		if (_append(&data, size, &cap, s->buf + s->pos, in_size) == -1) {
+			status = TINFL_STATUS_FAILED;
+			break;
+		}
+
+		s->pos += in_size;
+		out_ofs = (out_ofs + out_size) & (TINFL_LZ_DICT_SIZE - 1);
+
+	} while (status == TINFL_STATUS_NEEDS_MORE_INPUT
+		|| status == TINFL_STATUS_HAS_MORE_OUTPUT);
+
+end:
+	free(inflator);
+	free(window);
+
+	if (status != TINFL_STATUS_DONE) {
+		free(data);
+		return NULL;
+	}
+
+	return data;
+
+}
+
+/*
+ * Takes STORED data off the stream whose size is only given by the data
+ * descriptor after it. There is nothing to tell where it ends but a
+ * descriptor with its signature that gives the size read so far. Returns the
+ * data in a heap buffer, NULL if no such descriptor was found.
+ */
+static uint8_t*
+_take_stored(struct uz_stream* s, size_t* size) {
+
+	uint8_t* data = NULL;
+	uint8_t* p;
+	uint8_t* sig;
+	size_t cap = 0, run;
+	int found;
+
+	*size = 0;
+
+	for (;;) {
+
+		if (_stream_peek(s, 16) < 16) {
+			break;
+		}
+
+		/*
+		 * Only the bytes with a whole descriptor read after them are looked
+		 * at, and only where a signature starts is anything checked. Whatever
+		 * comes before that is taken as data in one go.
+		 */
+		p = s->buf + s->pos;
+		run = s->len - s->pos - 15;
+		found = 0;
+
+		if ((sig = memchr(p, 'P', run)) != NULL) {
+			run = sig - p;
+			found = MZ_READ_LE32(sig) == SIG_DESCRIPTOR
+				&& MZ_READ_LE32(sig + 8) == (mz_uint32) (*size + run)
+				&& MZ_READ_LE32(sig + 12) == (mz_uint32) (*size + run);
+			run += !found;
+		}
+
+		if (_append(&data, size, &cap, p, run) == -1) {
+			break;
+		}
+
+		s->pos += run;
+
+		if (found) {
+			return data != NULL ? data : malloc(1);
+		}
+
+	}
+
+	free(data);
+
+	return NULL;
+
+}
+
+/*
+ * Reads the data of an entry off the stream, along with the data descriptor
+ * after it if its local header says there is one. Fills in what the local
+ * header did not have.
+ */
+static int
+_take_entry_data(struct uz_stream* s, struct uz_entry* entry) {
+
+	mz_zip_archive_file_stat* stat = &entry->stat;
+	uint8_t dd[12];
+	size_t size;
+
+	if (!(stat->m_bit_flag & FLAG_DESCRIPTOR)) {
+
+		if (stat->m_is_encrypted) {
+			return _stream_take(s, NULL, stat->m_comp_size);
+		}
+
+		if ((entry->data = malloc(stat->m_comp_size + 1)) == NULL) {
+			return -1;
+		}
+
+		return _stream_take(s, entry->data, stat->m_comp_size);
+
+	}
+
+	/* Nothing else can be told apart from what follows it */
+	if (stat->m_is_encrypted) {
+		return -1;
+	}
+
+	switch (stat->m_method) {
+	case 0:
+		entry->data = _take_stored(s, &size);
+		break;
+	case MZ_DEFLATED:
+		entry->data = _take_deflated(s, &size);
+		break;
+	default:
+		return -1;
+	}
+
+	if (entry->data == NULL) {
+		return -1;
+	}
+
+	if (_stream_peek(s, 4) >= 4
+		&& MZ_READ_LE32(s->buf + s->pos) == SIG_DESCRIPTOR) {
+		s->pos += 4;
+	}
+
+	if (_stream_take(s, dd, sizeof(dd)) == -1
+		|| MZ_READ_LE32(dd + 4) != (mz_uint32) size) {
+		return -1;
+	}
+
+	stat->m_crc32 = MZ_READ_LE32(dd);
+	stat->m_comp_size = size;
+	stat->m_uncomp_size = MZ_READ_LE32(dd + 8);
+
+	return 0;
+
+}
+
+/* Makes room for one more entry in the epub's entries, names and index. */
+static int
+_grow_entries(struct uz_epub* uz) {
+
+	struct uz_entry** entries;
+	char** names;
+	int* slots;
+
+	if (uz->filenum == uz->entrycap) {
+
+		uz->entrycap = uz->entrycap > 0 ? uz->entrycap * 2 : 64;
+
+		entries = realloc(uz->entries, sizeof(*entries) * uz->entrycap);
+		if (entries == NULL) {
+			return -1;
+		}
+		uz->entries = entries;
+
+		names = realloc(uz->names, sizeof(*names) * (uz->entrycap + 1));
+		if (names == NULL) {
+			return -1;
+		}
+		uz->names = names;
+
+	}
+
+	/* Keep the index at most half full, like _index_entries does */
+	if ((size_t) (uz->filenum + 1) * 2 > uz->slotnum) {
+
+		if ((slots = malloc(sizeof(int) * uz->slotnum * 2)) == NULL) {
+			return -1;
+		}
+
+		free(uz->slots);
+		uz->slots = slots;
+		uz->slotnum *= 2;
+		memset(uz->slots, -1, sizeof(int) * uz->slotnum);
+
+		for (int i = 0; i < uz->filenum; i++) {
+			_index_name(uz, i);
+		}
+
+	}
+
+	return 0;
+
+}
+
+/*
+ * Looks name up as a file of an unpacked epub, and adds it as an entry that
+ * is STORED. Returns its index, or -1 if there is no such file.
+ */
+static int
+_locate_file(struct uz_epub* uz, char* name) {
+
+	struct stat st;
+	struct uz_entry* entry;
+
+	if (*name == '/' || strlen(name) >= MZ_ZIP_MAX_ARCHIVE_FILENAME_SIZE
+		|| fstatat(uz->fd, name, &st, 0) == -1 || !S_ISREG(st.st_mode)) {
+		return -1;
+	}
+
+	if (_grow_entries(uz) == -1
+		|| (entry = calloc(1, sizeof(struct uz_entry))) == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		return -1;
+	}
+
+	entry->stat.m_file_index = uz->filenum;
+	entry->stat.m_comp_size = st.st_size;
+	entry->stat.m_uncomp_size = st.st_size;
+	entry->stat.m_is_supported = 1;
+	strcpy(entry->stat.m_filename, name);
+
+	uz->entries[uz->filenum] = entry;
+	uz->names[uz->filenum] = entry->stat.m_filename;
+	_index_name(uz, uz->filenum);
+
+	return uz->filenum++;
+
+}
+
+/*
+ * uz_rm_tree does not check whether we have permission to delete a file as it
+ * will only be used to delete files that ebread itself created.
+ */
+void
+uz_rm_tree(char* path) {
+
+	char* pargv[] = { path, NULL };
+	FTS* fts;
+	FTSENT* cur;
+
+	fts = fts_open(pargv, FTS_NOSTAT, NULL);
+
+	while ((cur = fts_read(fts)) != NULL) {
+
+		switch (cur->fts_info) {
+		case FTS_DP:
+		case FTS_DNR:
+			rmdir(cur->fts_accpath);
+			break;
+		default:
+			unlink(cur->fts_accpath);
+			break;
+		}
+
+	}
+
+	fts_close(fts);
+
+}
+
+int
+uz_make_path(char* path) {
+
+	char* slash;
+	int rtrn;
+
+	/*
+	 * Usually most of the path already exists, so start at its end and only
+	 * walk back up while parent directories are missing.
+	 */
+	if (mkdir(path, 0777) == 0 || errno == EEXIST) {
+		return 0;
+	}
+
+	if (errno != ENOENT || (slash = strrchr(path, '/')) == NULL
+		|| slash == path) {
+		return -1;
+	}
+
+	*slash = '\0';
+	rtrn = uz_make_path(path);
+	*slash = '/';
+
+	if (rtrn == -1) {
+		return -1;
+	}
+
+	/* EEXIST means the directory already exists, which is to be expected. */
+	if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+		return -1;
+	}
+
+	return 0;
+
+}
+
+/*
+ * Entry names are used relative to the extract directory, leading slashes
+ * would make them absolute. Names that would climb out of it are never
+ * extracted, see _escapes_root.
+ */
+static char*
+_entry_relpath(struct uz_epub* uz, int i) {
+
+	return uz->names[i] + strspn(uz->names[i], "/");
+
+}
+
+/*
+ * Set of the directories created while extracting an epub. Directories are
+ * stored as the first len bytes of an entry's _entry_relpath, so nothing is
+ * copied.
+ */
+struct dir_cache {
+	struct dir_cache_slot {
+		int entry;
+		size_t len;
+	}* slots;
+	size_t slotnum;
+};
+
+static uint32_t
+_hash_bytes(char* bytes, size_t len) {
+
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char) bytes[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+
+}
+
+/*
+ * Adds the directory made of the first len bytes of entry's name to cache.
+ * Returns 1 if it was already there, 0 if it was added.
+ */
+static int
+_cache_dir(struct uz_epub* uz, struct dir_cache* cache, int entry,
+           size_t len) {
+
+	char* dir = _entry_relpath(uz, entry);
+	size_t slot = _hash_bytes(dir, len) & (cache->slotnum - 1);
+	struct dir_cache_slot* cur;
+
+	for (;; slot = (slot + 1) & (cache->slotnum - 1)) {
+
+		cur = &cache->slots[slot];
+
+		if (cur->entry == -1) {
+			cur->entry = entry;
+			cur->len = len;
+			return 0;
+		}
+
+		if (cur->len == len
+			&& memcmp(_entry_relpath(uz, cur->entry), dir, len) == 0) {
+			return 1;
+		}
+
+	}
+
+}
+
+/*
+ * Creates the parent directories of entry under rootfd. Directories already
+ * in cache are known to exist and are skipped without any syscalls.
+ */
+static int
+_make_entry_dirs(struct uz_epub* uz, struct dir_cache* cache, int rootfd,
+                 int entry) {
+
+	char* name = _entry_relpath(uz, entry);
+	char dir[PATHMAX + 1];
+	char* slash;
+
+	for (slash = strchr(name, '/'); slash != NULL;
+		slash = strchr(slash + 1, '/')) {
+
+		size_t len = slash - name;
+
+		/* Doubled up slashes name no directory */
+		if (*(slash - 1) == '/') {
+			continue;
+		}
+
+		if (len > PATHMAX || _cache_dir(uz, cache, entry, len)) {
+			continue;
+		}
+
+		memcpy(dir, name, len);
+		dir[len] = '\0';
+
+		if (mkdirat(rootfd, dir, 0777) == -1 && errno != EEXIST) {
+			fprintf(stderr, "Error creating extract directory: %s\n", dir);
+			return -1;
+		}
+
+	}
+
+	return 0;
+
+}
+
+/* A file an entry is being extracted to, see _write_entry. */
+struct uz_file {
+	char* name;
+	int fd;
+	uint64_t ofs;
+};
+
+static int
+_write_entry(char* buf, size_t len, void* opaque) {
+
+	struct uz_file* file = opaque;
+	size_t written = 0;
+	ssize_t w;
+
+	while (written < len) {
+		if ((w = pwrite(file->fd, buf + written, len - written,
+			file->ofs + written)) <= 0) {
+			fprintf(stderr, "%s: Could not write\n", file->name);
+			return -1;
+		}
+		written += w;
+	}
+
+	file->ofs += len;
+
+	return 0;
+
+}
+
+/*
+ * Whether the entry's name has a ".." component, which would have it created
+ * outside the extract directory.
+ */
+static int
+_escapes_root(struct uz_epub* uz, int i) {
+
+	char* comp = uz->names[i];
+	size_t complen;
+
+	while (*(comp += strspn(comp, "/")) != '\0') {
+
+		complen = strcspn(comp, "/");
+
+		if (complen == 2 && comp[0] == '.' && comp[1] == '.') {
+			return 1;
+		}
+
+		comp += complen;
+
+	}
+
+	return 0;
+
+}
+
+/* An entry being extracted through a worker's ring, see _queue_entry. */
+struct uz_queued {
+	struct wr_ring* ring;
+	struct wr_file* file;
+};
+
+/* Stands in for _write_entry where the worker has a ring */
+static int
+_queue_entry(char* buf, size_t len, void* opaque) {
+
+	struct uz_queued* queued = opaque;
+
+	return wr_write(queued->ring, queued->file, buf, len);
+
+}
+
+/* Stands in for _write_entry when testing, nothing is kept */
+static int
+_discard_entry(char* buf, size_t len, void* opaque) {
+
+	(void) buf;
+	(void) len;
+	(void) opaque;
+
+	return 0;
+
+}
+
+/* Longest name an entry's data is kept under in the store, see _store_key */
+#define STORE_KEY_MAX 96
+
+/*
+ * Names the entry's data in the store after its size and the SHA-256 digest of
+ * its compression method and compressed data. The compressed data settles what
+ * the entry inflates to, so entries are found in the store without being
+ * inflated, and no book can make its data pass for another's. Returns -1 for
+ * entries that are not kept there, such as empty ones.
+ */
+static int
+_store_key(struct uz_epub* uz, int i, char* key) {
+
+	mz_zip_archive_file_stat stat;
+	struct sha256 ctx;
+	uint8_t* data;
+	uint8_t method;
+	uint8_t digest[SHA256_SIZE];
+	int len;
+
+	if (_entry_stat(uz, i, &stat) == -1 || stat.m_uncomp_size == 0
+		|| stat.m_is_encrypted || (data = _entry_data(uz, &stat)) == NULL) {
+		return -1;
+	}
+
+	method = stat.m_method;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, &method, 1);
+	sha256_update(&ctx, data, stat.m_comp_size);
+	sha256_final(&ctx, digest);
+
+	len = snprintf(key, STORE_KEY_MAX, "%llu-",
+		(unsigned long long) stat.m_uncomp_size);
+
+	for (int j = 0; j < SHA256_SIZE; j++, len += 2) {
+		snprintf(key + len, STORE_KEY_MAX - len, "%02x", digest[j]);
+	}
+
+	return 0;
+
+}
+
+/* Shared by the workers extracting an epub, see _extract_worker. */
+struct uz_job {
+	struct uz_epub* uz;
+	/* Extract directory, files are created relative to it. -1 if testing */
+	int rootfd;
+	/* Indexes of the entries to extract, the ones the filter let through */
+	int* picked;
+	int pickednum;
+	/*
+	 * Threads each worker may inflate a large entry on, so that workers and
+	 * the threads they start stay within the threads the job was given
+	 */
+	int inflate_threads;
+	pthread_mutex_t lock;
+	int next;
+	int failed;
+	/*
+	 * Picked entries before prefetched were hinted to the kernel already,
+	 * they end at prefetch_end in the archive. See _extract_worker.
+	 */
+	int prefetched;
+	uint64_t prefetch_end;
+	/*
+	 * Directory entries are shared through across books, -1 if there is none.
+	 * Each picked entry has its key in the store, empty if it has none, and
+	 * linked is set for the ones that were linked out of it.
+	 */
+	int storefd;
+	char (*keys)[STORE_KEY_MAX];
+	char* linked;
+};
+
+/* What uz_filter's skip_media skips: images, fonts, audio and video */
+static char* media_globs[] = {
+	"*.jpg", "*.jpeg", "*.png", "*.gif", "*.webp", "*.bmp", "*.tif", "*.tiff",
+	"*.svg", "*.ttf", "*.otf", "*.woff", "*.woff2", "*.eot", "*.mp3", "*.m4a",
+	"*.aac", "*.ogg", "*.oga", "*.opus", "*.wav", "*.mp4", "*.m4v", "*.ogv",
+	"*.webm", "*.mov", NULL,
+};
+
+/* Whether name matches one of the globs in the NULL-terminated globs */
+static int
+_match_any(char** globs, char* name, int fnflags) {
+
+	for (char** p = globs; *p != NULL; p++) {
+		if (fnmatch(*p, name, fnflags) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+
+}
+
+/* Whether filter lets entry i through, a NULL filter lets everything through */
+static int
+_is_picked(struct uz_epub* uz, struct uz_filter* filter, int i) {
+
+	if (filter == NULL) {
+		return 1;
+	}
+
+	if (filter->include != NULL && !_match_any(filter->include, uz->names[i],
+		0)) {
+		return 0;
+	}
+
+	if (filter->exclude != NULL && _match_any(filter->exclude, uz->names[i],
+		0)) {
+		return 0;
+	}
+
+	return !filter->skip_media || !_match_any(media_globs, uz->names[i],
+		FNM_CASEFOLD);
+
+}
+
+/*
+ * Creates the file entry i is extracted to as a new one. A file already there
+ * is removed rather than written through, as it may be linked out of the store
+ * and shared by other books. Returns its fd, or -1 if it could not be created.
+ */
+static int
+_create_entry(struct uz_job* job, int i) {
+
+	char* path = _entry_relpath(job->uz, i);
+
+	if (unlinkat(job->rootfd, path, 0) == -1 && errno != ENOENT) {
+		return -1;
+	}
+
+	return openat(job->rootfd, path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+
+}
+
+/*
+ * Extracts a STORED entry of an archive by having the kernel copy its data
+ * from the archive's file into the new one, so none of it is ever copied
+ * through here. Its CRC-32 is only computed if verify is set, off the mapping,
+ * which reads it out of the page cache the copy reads from too.
+ */
+static int
+_copy_stored(struct uz_job* job, mz_zip_archive_file_stat* stat,
+             uint8_t* data, int verify) {
+
+	struct uz_epub* uz = job->uz;
+	int i = stat->m_file_index;
+	struct uz_file file;
+	int rtrn = 0;
+
+	if (_check_entry_budget(uz, stat, stat->m_uncomp_size) == -1
+		|| _spend(uz, stat, stat->m_uncomp_size, 1) == -1) {
+		return -1;
+	}
+
+	if (verify && mz_crc32(MZ_CRC32_INIT, data, stat->m_uncomp_size)
+		!= stat->m_crc32) {
+		fprintf(stderr, "%s: CRC-32 check failed\n", stat->m_filename);
+		return -1;
+	}
+
+	file.name = uz->names[i];
+	file.ofs = 0;
+	file.fd = _create_entry(job, i);
+
+	if (file.fd == -1) {
+		fprintf(stderr, "%s: Could not create\n", uz->names[i]);
+		return -1;
+	}
+
+#ifdef HAVE_COPY_FILE_RANGE
+	{
+		off_t in_ofs = data - uz->map;
+		ssize_t copied;
+
+		while (file.ofs < stat->m_uncomp_size) {
+			copied = copy_file_range(uz->fd, &in_ofs, file.fd, NULL,
+				stat->m_uncomp_size - file.ofs, 0);
+			if (copied <= 0) {
+				break;
+			}
+			file.ofs += copied;
+		}
+	}
+#endif
+
+	/* Whatever the kernel would not copy, such as across filesystems */
+	if (file.ofs < stat->m_uncomp_size) {
+		rtrn = _write_entry((char*) data + file.ofs,
+			stat->m_uncomp_size - file.ofs, &file);
+	}
+
+	close(file.fd);
+
+	return rtrn;
+
+}
+
+/*
+ * Whether entry i of an archive is STORED as is, so it can be extracted with
+ * _copy_stored. Its stat and where its data is are written to stat and data.
+ */
+static int
+_is_copyable(struct uz_epub* uz, int i, mz_zip_archive_file_stat* stat,
+             uint8_t** data) {
+
+	if (uz->stream != NULL || uz->dir || _entry_stat(uz, i, stat) == -1) {
+		return 0;
+	}
+
+	return stat->m_method == 0 && !stat->m_is_encrypted
+		&& stat->m_comp_size == stat->m_uncomp_size && stat->m_uncomp_size > 0
+		&& (*data = _entry_data(uz, stat)) != NULL;
+
+}
+
+/*
+ * Extracts entry i through the worker's ring, which creates, writes and closes
+ * its file in batches with those of other entries while inflating goes on.
+ */
+static int
+_extract_queued(struct uz_job* job, struct wr_ring* ring, int i, int verify) {
+
+	struct uz_epub* uz = job->uz;
+	struct uz_queued queued;
+	int rtrn;
+
+	queued.ring = ring;
+	queued.file = wr_create(ring, job->rootfd, _entry_relpath(uz, i),
+		uz->names[i]);
+
+	if (queued.file == NULL) {
+		fprintf(stderr, "%s: Could not create\n", uz->names[i]);
+		return -1;
+	}
+
+	rtrn = _stream_data(uz, i, job->inflate_threads, verify, _queue_entry,
+		&queued);
+
+	if (wr_close(ring, queued.file) == -1) {
+		rtrn = -1;
+	}
+
+	/* The file is only sure to be there to remove once the ring is done */
+	if (rtrn == -1 && _is_overspent(uz)) {
+		wr_finish(ring);
+		unlinkat(job->rootfd, _entry_relpath(uz, i), 0);
+	}
+
+	return rtrn;
+
+}
+
+/*
+ * Links the entry's file in the store into place, replacing whatever is there.
+ * Returns -1 if the store does not have it, or it could not be linked, the
+ * entry is then extracted as usual.
+ */
+static int
+_link_stored(struct uz_job* job, int i, char* key) {
+
+	char* path = _entry_relpath(job->uz, i);
+
+	if (unlinkat(job->rootfd, path, 0) == -1 && errno != ENOENT) {
+		return -1;
+	}
+
+	return linkat(job->storefd, key, job->rootfd, path, 0);
+
+}
+
+/*
+ * Adds what was extracted anew to the store, for the books extracted after.
+ * Entries that are already in it, such as ones another book added meanwhile,
+ * or that cannot be linked, are left alone. What is added is made read-only,
+ * so it is not edited in place by mistake. Extracting over a linked file
+ * replaces the link, see _create_entry.
+ */
+static void
+_fill_store(struct uz_job* job) {
+
+	for (int n = 0; n < job->pickednum; n++) {
+		if (!job->linked[n] && job->keys[n][0] != '\0'
+			&& linkat(job->rootfd, _entry_relpath(job->uz, job->picked[n]),
+			job->storefd, job->keys[n], 0) == 0) {
+			fchmodat(job->storefd, job->keys[n], 0444, 0);
+		}
+	}
+
+}
+
+/*
+ * Bytes of the archive workers keep asked for ahead of the entry they take.
+ * Entries are taken in the order they lie in the archive, so this is the
+ * stretch of it they are about to read.
+ */
+#define PREFETCH_AHEAD (8 * 1024 * 1024)
+
+/*
+ * Takes entries off the job one at a time until there are none left. Each
+ * worker inflates with a state of its own over the shared archive mapping, so
+ * they never wait on one another besides taking the next entry. Where it can,
+ * each also writes through a ring of its own, falling back to pwrite.
+ */
+static void*
+_extract_worker(void* arg) {
+
+	struct uz_job* job = arg;
+	struct uz_epub* uz = job->uz;
+	/* Nothing extracted is rendered */
+	int verify = !(uz->flags & UZ_CHECK_RENDERED);
+	struct wr_ring* ring = job->rootfd != -1 ? wr_open() : NULL;
+	mz_zip_archive_file_stat stat;
+	uint8_t* data;
+	struct uz_file file;
+	uint64_t ofs, len, limit;
+	int i, n, from, to, failed = 0;
+
+	for (;;) {
+
+		pthread_mutex_lock(&job->lock);
+
+		i = job->next++;
+		from = to = job->prefetched;
+
+		/* Refilled once half used up, so hints go out a few MB at a time */
+		if (i < job->pickednum
+			&& _entry_span(uz, job->picked[i], &ofs, &len) == 0
+			&& job->prefetch_end < ofs + PREFETCH_AHEAD / 2) {
+			limit = ofs + PREFETCH_AHEAD;
+			while (to < job->pickednum && job->prefetch_end < limit
+				&& _entry_span(uz, job->picked[to], &ofs, &len) == 0) {
+				job->prefetch_end = ofs + len;
+				to++;
+			}
+			job->prefetched = to;
+		}
+
+		pthread_mutex_unlock(&job->lock);
+
+		_prefetch(uz, job->picked + from, to - from);
+
+		/* A book that went over budget once is not read any further */
+		if (i >= job->pickednum || _is_overspent(uz)) {
+			break;
+		}
+
+		n = i;
+		i = job->picked[i];
+
+		/* Directories were already created before extraction started */
+		if (_is_directory(uz, i)) {
+			continue;
+		}
+
+		/* Entries some other book had are linked in, not inflated again */
+		if (job->storefd != -1 && _store_key(uz, i, job->keys[n]) == 0
+			&& _link_stored(job, i, job->keys[n]) == 0) {
+			job->linked[n] = 1;
+			continue;
+		}
+
+		/* Every entry is checked when testing, whatever the flags */
+		if (job->rootfd == -1) {
+			if (_stream_data(uz, i, job->inflate_threads, 1, _discard_entry,
+				NULL) == -1) {
+				failed = 1;
+			}
+			continue;
+		}
+
+		if (_is_copyable(uz, i, &stat, &data)) {
+			if (_copy_stored(job, &stat, data, verify) == -1) {
+				failed = 1;
+			}
+			continue;
+		}
+
+		if (ring != NULL) {
+			if (_extract_queued(job, ring, i, verify) == -1) {
+				failed = 1;
+			}
+			continue;
+		}
+
+		file.name = uz->names[i];
+		file.ofs = 0;
+		file.fd = _create_entry(job, i);
+
+		if (file.fd == -1) {
+			fprintf(stderr, "%s: Could not create\n", uz->names[i]);
+			failed = 1;
+			continue;
+		}
+
+		/* Extract by index, there is no need to look the name up again. */
+		if (_stream_data(uz, i, job->inflate_threads, verify, _write_entry,
+			&file) == -1) {
+			failed = 1;
+			/* Whatever an entry over budget left behind is not kept */
+			if (_is_overspent(uz)) {
+				unlinkat(job->rootfd, _entry_relpath(uz, i), 0);
+			}
+		}
+
+		close(file.fd);
+
+	}
+
+	if (ring != NULL) {
+		if (wr_finish(ring) == -1) {
+			failed = 1;
+		}
+		wr_free(ring);
+	}
+
+	if (failed) {
+		pthread_mutex_lock(&job->lock);
+		job->failed = 1;
+		pthread_mutex_unlock(&job->lock);
+	}
+
+	return NULL;
+
+}
+
+/*
+ * Runs the job's workers on up to threads threads, until every picked entry
+ * has been taken.
+ */
+static void
+_run_job(struct uz_job* job, int threads) {
+
+	pthread_t* workers;
+	int started = 0, total = threads;
+
+	job->next = 0;
+	job->failed = 0;
+	job->prefetched = 0;
+	job->prefetch_end = 0;
+	pthread_mutex_init(&job->lock, NULL);
+
+	if (threads > job->pickednum) {
+		threads = job->pickednum;
+	}
+
+	job->inflate_threads = threads > 1 ? total / threads : total;
+
+	if (threads > 1 && (workers = malloc(sizeof(pthread_t) * threads)) != NULL) {
+
+		for (; started < threads; started++) {
+			if (pthread_create(&workers[started], NULL, _extract_worker, job)
+				!= 0) {
+				break;
+			}
+		}
+
+		/* Whatever could not be handed to a thread is extracted here. */
+		if (started == 0) {
+			_extract_worker(job);
+		}
+
+		for (int i = 0; i < started; i++) {
+			pthread_join(workers[i], NULL);
+		}
+
+		free(workers);
+
+	} else {
+		_extract_worker(job);
+	}
+
+	pthread_mutex_destroy(&job->lock);
+
+}
+
+/*
+ * Opens epub to go through every entry of, which for a stream means reading
+ * it in full first, keeping only what filter lets through. Unpacked epubs are
+ * refused.
+ */
+static struct uz_epub*
+_open_whole(char* epub, struct uz_filter* filter, struct uz_budget* budget,
+            int threads, int flags) {
+
+	struct uz_epub* uz;
+	int index, rtrn;
+
+	if (strcmp(epub, "-") == 0) {
+		if ((uz = uz_open_stream(STDIN_FILENO, threads, flags)) == NULL) {
+			return NULL;
+		}
+		if (budget != NULL) {
+			uz_set_budget(uz, budget);
+		}
+		while ((rtrn = uz_next_entry(uz, &index)) == 1) {
+			if (!_is_picked(uz, filter, index)) {
+				uz_drop_entry(uz, index);
+			}
+		}
+		if (rtrn == -1) {
+			uz_close_epub(uz);
+			return NULL;
+		}
+	} else if ((uz = uz_open_epub(epub, threads, flags)) == NULL) {
+		return NULL;
+	} else if (budget != NULL) {
+		uz_set_budget(uz, budget);
+	}
+
+	if (uz->dir) {
+		fprintf(stderr, "%s: Already unpacked\n", epub);
+		uz_close_epub(uz);
+		return NULL;
+	}
+
+	return uz;
+
+}
+
+/* Opens the store directory, making it if need be, for job's picked entries */
+static int
+_open_store(struct uz_job* job, char* store) {
+
+	if (uz_make_path(store) == -1
+		|| (job->storefd = open(store, O_RDONLY | O_DIRECTORY)) == -1) {
+		fprintf(stderr, "Error opening store directory: %s\n", store);
+		return -1;
+	}
+
+	job->keys = calloc(job->pickednum + 1, STORE_KEY_MAX);
+	job->linked = calloc(job->pickednum + 1, 1);
+
+	if (job->keys == NULL || job->linked == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		close(job->storefd);
+		free(job->keys);
+		free(job->linked);
+		return -1;
+	}
+
+	return 0;
+
+}
+
+int
+uz_unzip_epub(char* epub, char* output_dir, struct uz_filter* filter,
+              struct uz_budget* budget, char* store, int threads, int flags) {
+
+	struct uz_epub* uz;
+	struct uz_job job;
+	struct dir_cache cache;
+
+	/*
+	 * Parent directories are all made before extracting, so a stream is read
+	 * in full first.
+	 */
+	if ((uz = _open_whole(epub, filter, budget, threads, flags)) == NULL) {
+		return -1;
+	}
+
+	/* The filter is settled on names alone, before anything is inflated */
+	if ((job.picked = malloc(sizeof(int) * (uz->filenum + 1))) == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		uz_close_epub(uz);
+		return -1;
+	}
+
+	job.pickednum = 0;
+
+	for (int i = 0; i < uz->filenum; i++) {
+		if (!_is_picked(uz, filter, i)) {
+			continue;
+		}
+		if (_escapes_root(uz, i)) {
+			fprintf(stderr, "%s: Not extracting outside of %s\n", uz->names[i],
+				output_dir);
+			continue;
+		}
+		job.picked[job.pickednum++] = i;
+	}
+
+	/* Workers take entries in the order they lie in, not the index's */
+	_sort_by_offset(uz, job.picked, job.pickednum);
+
+	if (uz_make_path(output_dir) == -1
+		|| (job.rootfd = open(output_dir, O_RDONLY | O_DIRECTORY)) == -1) {
+		fprintf(stderr, "Error creating extract directory: %s\n", output_dir);
+		free(job.picked);
+		uz_close_epub(uz);
+		return -1;
+	}
+
+	/* Keep the cache at most half full, entries have at most one new dir */
+	for (cache.slotnum = 16; cache.slotnum < (size_t) uz->filenum * 2;) {
+		cache.slotnum *= 2;
+	}
+
+	if ((cache.slots = malloc(sizeof(*cache.slots) * cache.slotnum)) == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		close(job.rootfd);
+		free(job.picked);
+		uz_close_epub(uz);
+		return -1;
+	}
+
+	for (size_t i = 0; i < cache.slotnum; i++) {
+		cache.slots[i].entry = -1;
+	}
+
+	/*
+	 * Every parent directory is created up front, so workers only ever have
+	 * to create files.
+	 */
+	for (int i = 0; i < job.pickednum; i++) {
+
+		if (_make_entry_dirs(uz, &cache, job.rootfd, job.picked[i]) == -1) {
+
+			free(cache.slots);
+
+			close(job.rootfd);
+
+			free(job.picked);
+
+			uz_close_epub(uz);
+
+			uz_rm_tree(output_dir);
+
+			return -1;
+		}
+
+	}
+
+	free(cache.slots);
+
+	job.uz = uz;
+	job.storefd = -1;
+	job.keys = NULL;
+	job.linked = NULL;
+
+	if (store != NULL && _open_store(&job, store) == -1) {
+		close(job.rootfd);
+		free(job.picked);
+		uz_close_epub(uz);
+		return -1;
+	}
+
+	_run_job(&job, threads);
+
+	/* A book that failed may have left anything behind, none of it is kept */
+	if (job.storefd != -1 && !job.failed) {
+		_fill_store(&job);
+	}
+
+	if (job.storefd != -1) {
+		close(job.storefd);
+	}
+
+	close(job.rootfd);
+
+	free(job.keys);
+	free(job.linked);
+	free(job.picked);
+
+	uz_close_epub(uz);
+
+	return job.failed ? -1 : 0;
+
+}
+
+int
+uz_test_epub(char* epub, struct uz_budget* budget, int threads, int flags) {
+
+	struct uz_epub* uz;
+	struct uz_job job;
+
+	if ((uz = _open_whole(epub, NULL, budget, threads, flags)) == NULL) {
+		return -1;
+	}
+
+	if ((job.picked = malloc(sizeof(int) * (uz->filenum + 1))) == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		uz_close_epub(uz);
+		return -1;
+	}
+
+	for (job.pickednum = 0; job.pickednum < uz->filenum; job.pickednum++) {
+		job.picked[job.pickednum] = job.pickednum;
+	}
+
+	_sort_by_offset(uz, job.picked, job.pickednum);
+
+	job.uz = uz;
+	job.rootfd = -1;
+	job.storefd = -1;
+	_run_job(&job, threads);
+
+	free(job.picked);
+
+	/* What had to be recovered is damaged, however well the rest reads */
+	if (uz->damaged) {
+		job.failed = 1;
+	}
+
+	uz_close_epub(uz);
+
+	return job.failed ? -1 : 0;
+
+}
+
+/* uz_read_entry, inflating large entries on up to threads threads */
+static char*
+_read_entry(struct uz_epub* epub, int index, int threads, size_t* size,
+            int* mapped) {
+
+	mz_zip_archive_file_stat stat;
+	uint8_t* data;
+	char* read;
+
+	if (_entry_stat(epub, index, &stat) == -1) {
+		fprintf(stderr, "Could not read archive entry %d\n", index);
+		return NULL;
+	}
+
+	/*
+	 * Nothing is inflated past the buffer, which holds what the entry claims,
+	 * so charging the claim up front is what holds the caps here.
+	 */
+	if (_check_entry_budget(epub, &stat, stat.m_uncomp_size) == -1
+		|| _spend(epub, &stat, stat.m_uncomp_size, 1) == -1) {
+		return NULL;
+	}
+
+	/* Empty files cannot be mapped, they are read as an empty string */
+	if (epub->dir) {
+		read = stat.m_uncomp_size > 0 ? (char*) _map_file(epub, &stat)
+			: calloc(1, 1);
+		if (read == NULL) {
+			fprintf(stderr, "%s: Could not read entry\n", stat.m_filename);
+			return NULL;
+		}
+		*size = stat.m_uncomp_size;
+		*mapped = stat.m_uncomp_size > 0;
+		return read;
+	}
+
+	if ((read = _map_stored_entry(epub, &stat)) != NULL) {
+		*size = stat.m_uncomp_size;
+		*mapped = 1;
+		return read;
+	}
+
+	if (stat.m_is_encrypted || (data = _entry_data(epub, &stat)) == NULL
+		|| (stat.m_method == 0 && stat.m_comp_size != stat.m_uncomp_size)) {
+		fprintf(stderr, "%s: Could not read entry\n", stat.m_filename);
+		return NULL;
+	}
+
+	if (stat.m_method != 0 && stat.m_method != MZ_DEFLATED) {
+		fprintf(stderr, "%s: Unsupported compression method\n",
+			stat.m_filename);
+		return NULL;
+	}
+
+	/* Leave room for a null terminator, the xml parser expects one. */
+	if ((read = malloc(stat.m_uncomp_size + 1)) == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		return NULL;
+	}
+
+	if (stat.m_method == 0) {
+		memcpy(read, data, stat.m_uncomp_size);
+	} else if (_inflate_entry(&stat, data, read, threads) == -1) {
+		fprintf(stderr, "%s: Could not inflate\n", stat.m_filename);
+		free(read);
+		return NULL;
+	}
+
+	if (!(epub->flags & UZ_CHECK_RENDERED)
+		&& mz_crc32(MZ_CRC32_INIT, (uint8_t*) read, stat.m_uncomp_size)
+		!= stat.m_crc32) {
+		fprintf(stderr, "%s: CRC-32 check failed\n", stat.m_filename);
+		free(read);
+		return NULL;
+	}
+
+	read[stat.m_uncomp_size] = '\0';
+	*size = stat.m_uncomp_size;
+	*mapped = 0;
+
+	return read;
+
+}
+
+/* What the mimetype entry of every epub holds, it is written first */
+#define EPUB_MIMETYPE "application/epub+zip"
+
+/* Entries each repack worker may get ahead of the one being written */
+#define PACK_AHEAD 4
+
+/* An entry as it is written back out, see _pack_entry. */
+struct uz_packed {
+	/* What is written, raw deflate data if method is MZ_DEFLATED */
+	uint8_t* data;
+	size_t size;
+	int method;
+	size_t uncomp_size;
+	uint32_t crc32;
+	MZ_TIME_T time;
+	/* The entry as it was read and what it deflated to, data is either */
+	char* read;
+	int mapped;
+	void* deflated;
+	/* 0 until packed, then 1 if it was, -1 if it could not be */
+	int state;
+};
+
+/* Shared by the workers packing entries and the thread writing them out. */
+struct uz_pack {
+	struct uz_epub* uz;
+	/* Indexes of the entries to write, in the order they are written */
+	int* order;
+	int ordernum;
+	struct uz_packed* packed;
+	int level;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Next entry to pack, and the first one that is not written yet */
+	int next;
+	int written;
+	/* Most entries packed ahead of written, which are all held in memory */
+	int window;
+	int failed;
+	/* Threads each worker may inflate a large entry on, see uz_job */
+	int inflate_threads;
+};
+
+/*
+ * Reads the entry at index and deflates it at the pack's level. Whichever is
+ * smallest of the new deflate data, what the archive already had and the
+ * entry as it is gets written. Every entry is checked against its CRC-32,
+ * which is written along with it.
+ */
+static int
+_pack_entry(struct uz_pack* pack, struct uz_packed* p, int index) {
+
+	struct uz_epub* uz = pack->uz;
+	mz_zip_archive_file_stat stat;
+	uint8_t* orig;
+	size_t len;
+
+	if (_entry_stat(uz, index, &stat) == -1) {
+		fprintf(stderr, "Could not read archive entry %d\n", index);
+		return -1;
+	}
+
+	p->time = stat.m_time;
+
+	if (_is_directory(uz, index)) {
+		return 0;
+	}
+
+	p->read = _read_entry(uz, index, pack->inflate_threads, &p->uncomp_size,
+		&p->mapped);
+
+	if (p->read == NULL) {
+		return -1;
+	}
+
+	/* Mapped entries were not checked, nor anything with UZ_CHECK_RENDERED */
+	p->crc32 = mz_crc32(MZ_CRC32_INIT, (uint8_t*) p->read, p->uncomp_size);
+
+	if (p->crc32 != stat.m_crc32) {
+		fprintf(stderr, "%s: CRC-32 check failed\n", stat.m_filename);
+		return -1;
+	}
+
+	p->data = (uint8_t*) p->read;
+	p->size = p->uncomp_size;
+
+	if (pack->level == 0 || p->size == 0) {
+		return 0;
+	}
+
+	if (stat.m_method == MZ_DEFLATED && stat.m_comp_size < p->size
+		&& (orig = _entry_data(uz, &stat)) != NULL) {
+		p->data = orig;
+		p->size = stat.m_comp_size;
+		p->method = MZ_DEFLATED;
+	}
+
+	p->deflated = tdefl_compress_mem_to_heap(p->read, p->uncomp_size, &len,
+		tdefl_create_comp_flags_from_zip_params(pack->level,
+		-MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY));
+
+	if (p->deflated != NULL && len < p->size) {
+		p->data = p->deflated;
+		p->size = len;
+		p->method = MZ_DEFLATED;
+	} else {
+		free(p->deflated);
+		p->deflated = NULL;
+	}
+
+	return 0;
+
+}
+
+static void
+_free_packed(struct uz_packed* p) {
+
+	free(p->deflated);
+	p->deflated = NULL;
+
+	if (p->read != NULL && p->mapped) {
+		uz_unmap_entry(p->read, p->uncomp_size);
+	} else {
+		free(p->read);
+	}
+	p->read = NULL;
+
+}
+
+/* Hands miniz a STORED entry's data, see _write_packed */
+static size_t
+_read_packed(void* opaque, mz_uint64 ofs, void* buf, size_t n) {
+
+	struct uz_packed* p = opaque;
+
+	if (ofs >= p->size) {
+		return 0;
+	}
+
+	if (n > p->size - ofs) {
+		n = p->size - ofs;
+	}
+
+	memcpy(buf, p->data + ofs, n);
+
+	return n;
+
+}
+
+/*
+ * Adds a packed entry to zip. STORED entries go in with their sizes in the
+ * local header and no data descriptor, so readers going through the archive
+ * front to back do not have to guess where they end. That is also what the
+ * epub standard asks of mimetype.
+ */
+static int
+_write_packed(mz_zip_archive* zip, char* name, struct uz_packed* p) {
+
+	mz_bool ok;
+
+	if (p->method == MZ_DEFLATED) {
+		ok = mz_zip_writer_add_mem_ex_v2(zip, name, p->data, p->size, NULL, 0,
+			MZ_ZIP_FLAG_COMPRESSED_DATA, p->uncomp_size, p->crc32, &p->time,
+			NULL, 0, NULL, 0);
+	} else if (name[0] != '\0' && name[strlen(name) - 1] == '/') {
+		ok = mz_zip_writer_add_mem_ex_v2(zip, name, NULL, 0, NULL, 0, 0, 0, 0,
+			&p->time, NULL, 0, NULL, 0);
+	} else {
+		ok = mz_zip_writer_add_read_buf_callback(zip, name, _read_packed, p,
+			p->size, &p->time, NULL, 0, MZ_ZIP_FLAG_WRITE_HEADER_SET_SIZE,
+			NULL, 0, NULL, 0);
+	}
+
+	if (!ok) {
+		fprintf(stderr, "%s: Could not write, %s\n", name,
+			mz_zip_get_error_string(mz_zip_get_last_error(zip)));
+		return -1;
+	}
+
+	return 0;
+
+}
+
+/*
+ * Packs entries in order, the next one not yet taken, staying at most window
+ * entries ahead of the one being written.
+ */
+static void*
+_pack_worker(void* arg) {
+
+	struct uz_pack* pack = arg;
+	int n, state;
+
+	for (;;) {
+
+		pthread_mutex_lock(&pack->lock);
+
+		while (pack->next < pack->ordernum && !pack->failed
+			&& pack->next >= pack->written + pack->window) {
+			pthread_cond_wait(&pack->cond, &pack->lock);
+		}
+
+		if (pack->next >= pack->ordernum || pack->failed) {
+			pthread_mutex_unlock(&pack->lock);
+			break;
+		}
+
+		n = pack->next++;
+
+		pthread_mutex_unlock(&pack->lock);
+
+		state = _pack_entry(pack, &pack->packed[n], pack->order[n]) == -1
+			? -1 : 1;
+
+		pthread_mutex_lock(&pack->lock);
+		pack->packed[n].state = state;
+		pthread_cond_broadcast(&pack->cond);
+		pthread_mutex_unlock(&pack->lock);
+
+	}
+
+	return NULL;
+
+}
+
+/*
+ * Writes every entry of the pack to zip in order, mimetype first. Entries
+ * are packed on up to threads workers while this thread writes out the ones
+ * that are done.
+ */
+static int
+_write_pack(struct uz_pack* pack, mz_zip_archive* zip, int mimetype,
+            int threads) {
+
+	struct uz_packed mime = {
+		.data = (uint8_t*) EPUB_MIMETYPE,
+		.size = strlen(EPUB_MIMETYPE),
+	};
+	mz_zip_archive_file_stat stat;
+	pthread_t* workers = NULL;
+	int started = 0, failed = 0, total = threads;
+
+	mime.time = mimetype != -1 && _entry_stat(pack->uz, mimetype, &stat) == 0
+		? stat.m_time : time(NULL);
+
+	if (_write_packed(zip, "mimetype", &mime) == -1) {
+		return -1;
+	}
+
+	if (threads > pack->ordernum) {
+		threads = pack->ordernum;
+	}
+
+	pack->window = threads * PACK_AHEAD;
+	pack->inflate_threads = threads > 1 ? total / threads : total;
+
+	if (threads > 1 && (workers = malloc(sizeof(pthread_t) * threads))
+		!= NULL) {
+		for (; started < threads; started++) {
+			if (pthread_create(&workers[started], NULL, _pack_worker, pack)
+				!= 0) {
+				break;
+			}
+		}
+	}
+
+	for (int n = 0; n < pack->ordernum && !failed; n++) {
+
+		struct uz_packed* p = &pack->packed[n];
+		int i = pack->order[n];
+
+		/* Without workers, every entry is packed here as it comes up */
+		if (started == 0) {
+			p->state = _pack_entry(pack, p, i) == -1 ? -1 : 1;
+		}
+
+		pthread_mutex_lock(&pack->lock);
+		while (p->state == 0) {
+			pthread_cond_wait(&pack->cond, &pack->lock);
+		}
+		pthread_mutex_unlock(&pack->lock);
+
+		if (p->state == -1 || _write_packed(zip, _entry_relpath(pack->uz, i),
+			p) == -1) {
+			failed = 1;
+		}
+
+		_free_packed(p);
+
+		/* Workers stop taking entries once anything failed */
+		pthread_mutex_lock(&pack->lock);
+		pack->failed = failed;
+		pack->written = n + 1;
+		pthread_cond_broadcast(&pack->cond);
+		pthread_mutex_unlock(&pack->lock);
+
+	}
+
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	free(workers);
+
+	/* Whatever was packed ahead of a failure is never written */
+	for (int n = 0; n < pack->ordernum; n++) {
+		_free_packed(&pack->packed[n]);
+	}
+
+	return failed ? -1 : 0;
+
+}
+
+int
+uz_repack_epub(struct uz_epub* epub, char* output, char* keep, int level,
+               int threads) {
+
+	struct uz_pack pack;
+	mz_zip_archive zip;
+	char tmp[PATHMAX + 1];
+	FILE* file;
+	int fd, mimetype = -1, rtrn = 0;
+
+	if (epub->dir) {
+		fprintf(stderr, "Unpacked epubs cannot be repacked\n");
+		return -1;
+	}
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", output) >= (int) sizeof(tmp)) {
+		fprintf(stderr, "%s: Path too long\n", output);
+		return -1;
+	}
+
+	pack.order = malloc(sizeof(int) * (epub->filenum + 1));
+	pack.packed = calloc(epub->filenum + 1, sizeof(struct uz_packed));
+
+	if (pack.order == NULL || pack.packed == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		free(pack.order);
+		free(pack.packed);
+		return -1;
+	}
+
+	pack.ordernum = 0;
+
+	for (int i = 0; i < epub->filenum; i++) {
+		if (strcmp(_entry_relpath(epub, i), "mimetype") == 0) {
+			mimetype = i;
+		} else if (keep == NULL || keep[i]) {
+			pack.order[pack.ordernum++] = i;
+		}
+	}
+
+	/*
+	 * Written next to output and renamed over it once complete, so a failed
+	 * repack leaves nothing behind, and output may be the epub being read.
+	 */
+	if ((fd = mkstemp(tmp)) == -1) {
+		fprintf(stderr, "%s: Could not create\n", output);
+		free(pack.order);
+		free(pack.packed);
+		return -1;
+	}
+
+	fchmod(fd, 0644);
+
+	memset(&zip, 0, sizeof(zip));
+
+	if ((file = fdopen(fd, "wb")) == NULL
+		|| !mz_zip_writer_init_cfile(&zip, file, 0)) {
+		fprintf(stderr, "%s: Could not create\n", output);
+		if (file != NULL) {
+			fclose(file);
+		} else {
+			close(fd);
+		}
+		unlink(tmp);
+		free(pack.order);
+		free(pack.packed);
+		return -1;
+	}
+
+	pack.uz = epub;
+	pack.level = level;
+	pack.next = 0;
+	pack.written = 0;
+	pack.failed = 0;
+	pthread_mutex_init(&pack.lock, NULL);
+	pthread_cond_init(&pack.cond, NULL);
+
+	if (_write_pack(&pack, &zip, mimetype, threads) == -1
+		|| !mz_zip_writer_finalize_archive(&zip)) {
+		rtrn = -1;
+	}
+
+	mz_zip_writer_end(&zip);
+
+	if (fclose(file) == EOF && rtrn == 0) {
+		fprintf(stderr, "%s: Could not write\n", output);
+		rtrn = -1;
+	}
+
+	if (rtrn == 0 && rename(tmp, output) == -1) {
+		fprintf(stderr, "%s: Could not write\n", output);
+		rtrn = -1;
+	}
+
+	if (rtrn == -1) {
+		unlink(tmp);
+	}
+
+	pthread_cond_destroy(&pack.cond);
+	pthread_mutex_destroy(&pack.lock);
+	free(pack.order);
+	free(pack.packed);
+
+	return rtrn;
+
+}
+
+/*
+ * Opens an unpacked epub. Nothing is read up front, files are only looked up
+ * once something asks for them.
+ */
+static struct uz_epub*
+_open_dir(char* epub, int threads, int flags) {
+
+	struct uz_epub* uz;
+
+	if ((uz = malloc(sizeof(struct uz_epub))) == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		return NULL;
+	}
+
+	uz->map = NULL;
+	uz->mapsize = 0;
+	uz->filenum = 0;
+	uz->names = NULL;
+	uz->namepool = NULL;
+	uz->slotnum = 16;
+	uz->flags = flags;
+	uz->threads = threads;
+	uz->stream = NULL;
+	uz->entries = NULL;
+	uz->entrycap = 0;
+	uz->dir = 1;
+	memset(&uz->budget, 0, sizeof(uz->budget));
+	uz->spent = 0;
+	uz->overspent = 0;
+	pthread_mutex_init(&uz->budget_lock, NULL);
+	uz->damaged = 0;
+	uz->arena = NULL;
+	uz->slots = malloc(sizeof(int) * uz->slotnum);
+
+	mz_zip_zero_struct(&uz->zip);
+
+	if ((uz->fd = open(epub, O_RDONLY | O_DIRECTORY)) == -1) {
+		fprintf(stderr, "%s: Could not open\n", epub);
+		uz_close_epub(uz);
+		return NULL;
+	}
+
+	if (uz->slots == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		uz_close_epub(uz);
+		return NULL;
+	}
+
+	memset(uz->slots, -1, sizeof(int) * uz->slotnum);
+
+	return uz;
+
+}
+
+/*
+ * Skips ahead to the next local header on the stream, past whatever could not
+ * be read as an entry. Returns 0 if there is none left.
+ */
+static int
+_stream_resync(struct uz_stream* s) {
+
+	while (_stream_peek(s, 4) >= 4) {
+		if (MZ_READ_LE32(s->buf + s->pos) == MZ_READ_LE32(epub_magic)) {
+			return 1;
+		}
+		s->pos++;
+	}
+
+	s->done = 1;
+
+	return 0;
+
+}
+
+/*
+ * Rebuilds the entries of an archive whose central directory cannot be used
+ * out of its local headers, reading it front to back as a stream would be.
+ * Entries that cannot be read are skipped up to the next local header, so a
+ * truncated archive keeps every entry before the cut. The archive is not
+ * mapped any longer afterwards, the entries' data is read onto the heap.
+ */
+static struct uz_epub*
+_recover(struct uz_epub* uz, char* epub) {
+
+	int index, rtrn;
+
+	munmap(uz->map, uz->mapsize);
+	uz->map = NULL;
+	uz->mapsize = 0;
+	uz->filenum = 0;
+	uz->slotnum = 16;
+	uz->slots = malloc(sizeof(int) * uz->slotnum);
+	uz->stream = malloc(sizeof(struct uz_stream));
+
+	if (uz->slots == NULL || uz->stream == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		uz_close_epub(uz);
+		return NULL;
+	}
+
+	memset(uz->slots, -1, sizeof(int) * uz->slotnum);
+	uz->stream->fd = uz->fd;
+	uz->stream->pos = 0;
+	uz->stream->len = 0;
+	uz->stream->total = 0;
+	uz->stream->done = 0;
+
+	if (lseek(uz->fd, 0, SEEK_SET) == -1) {
+		fprintf(stderr, "%s: Could not read\n", epub);
+		uz_close_epub(uz);
+		return NULL;
+	}
+
+	while ((rtrn = uz_next_entry(uz, &index)) != 0) {
+		if (rtrn == -1) {
+			uz->damaged = 1;
+			if (!_stream_resync(uz->stream)) {
+				break;
+			}
+		}
+	}
+
+	if (uz->filenum == 0) {
+		fprintf(stderr, "%s: No entries could be recovered\n", epub);
+		uz_close_epub(uz);
+		return NULL;
+	}
+
+	return uz;
+
+}
+
+struct uz_epub*
+uz_open_epub(char* epub, int threads, int flags) {
+
+	struct uz_epub* uz;
+	struct stat st;
+
+	if (stat(epub, &st) == 0 && S_ISDIR(st.st_mode)) {
+		return _open_dir(epub, threads, flags);
+	}
+
+	if ((uz = malloc(sizeof(struct uz_epub))) == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		return NULL;
+	}
+
+	if ((uz->map = _map_epub(epub, &uz->fd, &uz->mapsize)) == NULL) {
+		free(uz);
+		return NULL;
+	}
+
+	if (!_is_epub(uz->map, uz->mapsize)) {
+		fprintf(stderr, "%s: Not an epub.\n", epub);
+		munmap(uz->map, uz->mapsize);
+		close(uz->fd);
+		free(uz);
+		return NULL;
+	}
+
+	uz->names = NULL;
+	uz->namepool = NULL;
+	uz->slots = NULL;
+	uz->flags = flags;
+	uz->threads = threads;
+	uz->stream = NULL;
+	uz->entries = NULL;
+	uz->entrycap = 0;
+	uz->dir = 0;
+	memset(&uz->budget, 0, sizeof(uz->budget));
+	uz->spent = 0;
+	uz->overspent = 0;
+	pthread_mutex_init(&uz->budget_lock, NULL);
+	uz->damaged = 0;
+	uz->arena = NULL;
+
+	mz_zip_zero_struct(&uz->zip);
+
+	if (flags & UZ_RECOVER) {
+		return _recover(uz, epub);
+	}
+
+	if ((uz->arena = _take_arena()) == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		uz_close_epub(uz);
+		return NULL;
+	}
+
+	uz->zip.m_pAlloc = _mz_alloc;
+	uz->zip.m_pFree = _mz_free;
+	uz->zip.m_pRealloc = _mz_realloc;
+	uz->zip.m_pAlloc_opaque = uz->arena;
+
+	if (!mz_zip_reader_init_mem(&uz->zip, uz->map, uz->mapsize,
+		READER_FLAGS)) {
+		fprintf(stderr, "%s: %s, recovering entries from local headers\n",
+			epub, mz_zip_get_error_string(mz_zip_get_last_error(&uz->zip)));
+		uz->damaged = 1;
+		return _recover(uz, epub);
+	}
+
+	if (_index_entries(uz) == -1) {
+		uz_close_epub(uz);
+		return NULL;
+	}
+
+	return uz;
+
+}
+
+struct uz_epub*
+uz_open_stream(int fd, int threads, int flags) {
+
+	struct uz_epub* uz;
+
+	if ((uz = malloc(sizeof(struct uz_epub))) == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		return NULL;
+	}
+
+	uz->fd = -1;
+	uz->map = NULL;
+	uz->mapsize = 0;
+	uz->filenum = 0;
+	uz->names = NULL;
+	uz->namepool = NULL;
+	uz->slotnum = 16;
+	uz->flags = flags;
+	uz->threads = threads;
+	uz->entries = NULL;
+	uz->entrycap = 0;
+	uz->dir = 0;
+	memset(&uz->budget, 0, sizeof(uz->budget));
+	uz->spent = 0;
+	uz->overspent = 0;
+	pthread_mutex_init(&uz->budget_lock, NULL);
+	uz->damaged = 0;
+	uz->arena = NULL;
+	uz->slots = malloc(sizeof(int) * uz->slotnum);
+	uz->stream = malloc(sizeof(struct uz_stream));
+
+	mz_zip_zero_struct(&uz->zip);
+
+	if (uz->slots == NULL || uz->stream == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		uz_close_epub(uz);
+		return NULL;
+	}
+
+	memset(uz->slots, -1, sizeof(int) * uz->slotnum);
+	uz->stream->fd = fd;
+	uz->stream->pos = 0;
+	uz->stream->len = 0;
+	uz->stream->total = 0;
+	uz->stream->done = 0;
+
+	return uz;
+
+}
+
+int
+uz_next_entry(struct uz_epub* epub, int* index) {
+
+	struct uz_stream* s = epub->stream;
+	struct uz_entry* entry;
+	uint8_t ldh[LDH_SIZE];
+	size_t namelen;
+	ssize_t got;
+	mz_uint32 sig;
+	/* Where the local header starts, counting from the start of the stream */
+	uint64_t ofs;
+
+	if (s->done) {
+		return 0;
+	}
+
+	if ((got = _stream_peek(s, 4)) == -1) {
+		fprintf(stderr, "Could not read epub\n");
+		return -1;
+	}
+
+	sig = got >= 4 ? MZ_READ_LE32(s->buf + s->pos) : 0;
+	ofs = s->total - (s->len - s->pos);
+
+	/*
+	 * The central directory only repeats what the local headers said. It is
+	 * read through anyway, so whatever writes the stream is not cut off.
+	 */
+	if (got == 0 || sig == SIG_CENTRAL_DIR || sig == SIG_END) {
+		while (_stream_peek(s, STREAM_BUF) > 0) {
+			s->pos = s->len;
+		}
+		s->done = 1;
+		return 0;
+	}
+
+	if (sig != MZ_READ_LE32(epub_magic) || _stream_take(s, ldh, LDH_SIZE) == -1
+		|| (namelen = MZ_READ_LE16(ldh + LDH_FILENAME_LEN))
+		>= MZ_ZIP_MAX_ARCHIVE_FILENAME_SIZE) {
+		fprintf(stderr, "Entry %d: Bad local header\n", epub->filenum + 1);
+		return -1;
+	}
+
+	if (_grow_entries(epub) == -1
+		|| (entry = calloc(1, sizeof(struct uz_entry))) == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		return -1;
+	}
+
+	entry->stat.m_file_index = epub->filenum;
+	entry->stat.m_local_header_ofs = ofs;
+	entry->stat.m_bit_flag = MZ_READ_LE16(ldh + LDH_FLAGS);
+	entry->stat.m_method = MZ_READ_LE16(ldh + LDH_METHOD);
+	entry->stat.m_crc32 = MZ_READ_LE32(ldh + LDH_CRC32);
+	entry->stat.m_comp_size = MZ_READ_LE32(ldh + LDH_COMP_SIZE);
+	entry->stat.m_uncomp_size = MZ_READ_LE32(ldh + LDH_UNCOMP_SIZE);
+	entry->stat.m_is_encrypted = entry->stat.m_bit_flag & FLAG_ENCRYPTED;
+	entry->stat.m_is_supported = 1;
+	entry->stat.m_time = _dos_to_time(MZ_READ_LE16(ldh + LDH_TIME),
+		MZ_READ_LE16(ldh + LDH_DATE));
+
+	if (_stream_take(s, (uint8_t*) entry->stat.m_filename, namelen) == -1
+		|| _stream_take(s, NULL, MZ_READ_LE16(ldh + LDH_EXTRA_LEN)) == -1) {
+		fprintf(stderr, "Entry %d: Bad local header\n", epub->filenum + 1);
+		free(entry);
+		return -1;
+	}
+
+	entry->stat.m_filename[namelen] = '\0';
+	entry->stat.m_is_directory = namelen > 0
+		&& entry->stat.m_filename[namelen - 1] == '/';
+
+	if (_take_entry_data(s, entry) == -1) {
+		fprintf(stderr, "%s: Could not read entry\n", entry->stat.m_filename);
+		free(entry->data);
+		free(entry);
+		return -1;
+	}
+
+	epub->entries[epub->filenum] = entry;
+	epub->names[epub->filenum] = entry->stat.m_filename;
+	_index_name(epub, epub->filenum);
+	*index = epub->filenum++;
+
+	return 1;
+
+}
+
+void
+uz_drop_entry(struct uz_epub* epub, int index) {
+
+	if (epub->stream != NULL && index >= 0 && index < epub->filenum) {
+		free(epub->entries[index]->data);
+		epub->entries[index]->data = NULL;
+	}
+
+}
+
+void
+uz_set_budget(struct uz_epub* epub, struct uz_budget* budget) {
+
+	epub->budget = *budget;
+
+}
+
+void
+uz_prefetch(struct uz_epub* epub, int* indexes, int n) {
+
+	int* sorted;
+
+	if (epub->map == NULL || (sorted = malloc(sizeof(int) * (n + 1)))
+		== NULL) {
+		return;
+	}
+
+	memcpy(sorted, indexes, sizeof(int) * n);
+	_sort_by_offset(epub, sorted, n);
+	_prefetch(epub, sorted, n);
+
+	free(sorted);
+
+}
+
+void
+uz_memory_use(struct uz_epub* epub, struct uz_memory* mem) {
+
+	struct arena_stats stats = { 0, 0, 0 };
+
+	if (epub->arena != NULL) {
+		arena_stats(epub->arena, &stats);
+	}
+
+	mem->used = stats.used;
+	mem->peak = stats.peak;
+	mem->reserved = stats.reserved;
+
+}
+
+int
+uz_entry_count(struct uz_epub* epub) {
+
+	return epub->filenum;
+
+}
+
+int
+uz_entry_info(struct uz_epub* epub, int index, struct uz_info* info) {
+
+	mz_zip_archive_file_stat stat;
+
+	if (_entry_stat(epub, index, &stat) == -1) {
+		return -1;
+	}
+
+	/* The stat's name is a copy that is gone once this returns */
+	info->name = epub->names[index];
+	info->comp_size = stat.m_comp_size;
+	info->uncomp_size = stat.m_uncomp_size;
+	info->method = stat.m_method;
+	info->crc32 = stat.m_crc32;
+	info->offset = stat.m_local_header_ofs;
+
+	return 0;
+
+}
+
+int
+uz_locate_entry(struct uz_epub* epub, char* name) {
+
+	size_t slot = _hash_name(name) & (epub->slotnum - 1);
+	int match = -1;
+
+	/* An exact match wins over one that only differs in case. */
+	for (; epub->slots[slot] != -1; slot = (slot + 1) & (epub->slotnum - 1)) {
+
+		char* cur = epub->names[epub->slots[slot]];
+
+		if (strcmp(cur, name) == 0) {
+			return epub->slots[slot];
+		}
+
+		if (match == -1 && strcasecmp(cur, name) == 0) {
+			match = epub->slots[slot];
+		}
+
+	}
+
+	if (match == -1 && epub->dir) {
+		return _locate_file(epub, name);
+	}
+
+	return match;
+
+}
+
+char*
+uz_read_entry(struct uz_epub* epub, int index, size_t* size, int* mapped) {
+
+	return _read_entry(epub, index, epub->threads, size, mapped);
+
+}
+
+void
+uz_close_epub(struct uz_epub* epub) {
+
+	mz_zip_reader_end(&epub->zip);
+	if (epub->map != NULL) {
+		munmap(epub->map, epub->mapsize);
+	}
+	if (epub->fd != -1) {
+		close(epub->fd);
+	}
+	for (int i = 0; i < epub->filenum && epub->entries != NULL; i++) {
+		free(epub->entries[i]->data);
+		free(epub->entries[i]);
+	}
+	free(epub->entries);
+	free(epub->stream);
+	/* A central directory's index is in the arena, a stream's is not */
+	if (epub->arena == NULL || epub->stream != NULL) {
+		free(epub->names);
+		free(epub->namepool);
+		free(epub->slots);
+	}
+	if (epub->arena != NULL) {
+		_give_arena(epub->arena);
+	}
+	pthread_mutex_destroy(&epub->budget_lock);
+	free(epub);
+
+}
+
+int
+uz_stream_entry(struct uz_epub* epub, int index,
+                int (*func)(char* buf, size_t len, void* opaque),
+                void* opaque) {
+
+	/* Streamed entries are the ones being rendered, they are always checked */
+	return _stream_data(epub, index, epub->threads, 1, func, opaque);
+
+}
+
+void
+uz_unmap_entry(char* entry, size_t size) {
+
+	size_t pageofs = (uintptr_t) entry % sysconf(_SC_PAGESIZE);
+
+	munmap(entry - pageofs, size + pageofs);
+
+}
+
+void
+uz_clean_path(char* path) {
+
+	char* src = path;
+	char* dst = path;
+	size_t complen;
+
+	while (*(src += strspn(src, "/")) != '\0') {
+
+		complen = strcspn(src, "/");
+
+		if (complen == 1 && *src == '.') {
+			;
+		} else if (complen == 2 && src[0] == '.' && src[1] == '.') {
+			/* Back up to the previous component, if there is one. */
+			if (dst > path) {
+				dst--;
+				while (dst > path && *(dst - 1) != '/') {
+					dst--;
+				}
+			}
+		} else {
+			memmove(dst, src, complen);
+			dst += complen;
+			if (src[complen] == '/') {
+				*(dst++) = '/';
+			}
+		}
+
+		src += complen;
+
+	}
+
+	*dst = '\0';
+
+}
@@ -4,12 +4,236 @@
  */
 #define ZIP_PATH_MAX 260
 
+/* An epub archive opened for in-memory reading. */
+struct uz_epub;
+
+/*
+ * Flag for uz_open_epub and uz_unzip_epub: only check the CRC-32 of entries
+ * that are rendered, which are the ones read with uz_stream_entry. Entries
+ * read with uz_read_entry or extracted are taken as they are.
+ */
+#define UZ_CHECK_RENDERED 0x1
+
+/*
+ * Flag for uz_open_epub and uz_unzip_epub: ignore the central directory and
+ * recover the entries from their local headers, as is done anyway when the
+ * central directory cannot be read, such as when the archive was cut short.
+ */
+#define UZ_RECOVER 0x2
+
+/*
+ * Which entries uz_unzip_epub extracts. Globs are matched against an entry's
+ * whole archive path as with fnmatch(3), so "*" also matches slashes.
+ */
+struct uz_filter {
+	/* NULL-terminated globs an entry has to match one of, NULL for any */
+	char** include;
+	/* NULL-terminated globs an entry must not match any of, NULL for none */
+	char** exclude;
+	/* Skip images, fonts, audio and video, by their file extension */
+	int skip_media;
+};
+
+/*
+ * Caps on how much an epub may inflate to, 0 leaves a cap off. They are
+ * enforced on the bytes actually inflated, as they are inflated, whatever the
+ * archive's headers claim. Headers claiming more are refused up front.
+ */
+struct uz_budget {
+	/* Most bytes a single entry may inflate to */
+	size_t entry_max;
+	/* Most bytes all entries read from the epub may inflate to together */
+	size_t total_max;
+	/* Most bytes an entry may inflate to per byte of compressed data */
+	unsigned long ratio_max;
+};
+
+/* An entry as its central directory record describes it, see uz_entry_info */
+struct uz_info {
+	char* name;
+	size_t comp_size;
+	size_t uncomp_size;
+	/* Compression method, 0 for STORED and 8 for DEFLATE */
+	int method;
+	unsigned long crc32;
+	/* Offset of the entry's local header in the archive */
+	size_t offset;
+};
+
+/*
+ * What an epub's central directory and the index of its names take up, see
+ * uz_memory_use. They are kept in an arena that is reset when the epub is
+ * closed, and reused for the next epub opened on the same thread.
+ */
+struct uz_memory {
+	/* Bytes in use for the epub */
+	size_t used;
+	/* Most bytes ever in use at once, by any epub the arena was used for */
+	size_t peak;
+	/* Bytes the arena holds, whether in use or not */
+	size_t reserved;
+};
+
 /* Basically just rm -r */
 void uz_rm_tree(char* path);
 
 /* Basically just mkdir -p */
 int uz_make_path(char* path);
 
-/* Unzips contents of epub to outputdir */
-/* NOTE: output_dir must end with a slash character */
-int uz_unzip_epub (char* epub, char* output_dir);
+/*
+ * Unzips contents of epub to outputdir, inflating entries on up to threads
+ * threads at once. Only entries filter lets through are extracted, all of
+ * them if filter is NULL. Extraction stops at the first entry that goes over
+ * budget, which is then removed, budget may be NULL for no caps. threads and
+ * flags are passed on to uz_open_epub. If epub is "-", it is read off stdin in
+ * full first, keeping only what filter lets through. Unpacked epubs are
+ * refused.
+ *
+ * If store is not NULL, it is a directory that keeps one copy of every file
+ * extracted, shared by all the books extracted with it. Files it already has
+ * are hard-linked into place rather than inflated and written again, and once
+ * a book is extracted without errors, its new files are added to it. It has
+ * to be on the same filesystem as output_dir.
+ */
+/* NOTE: output_dir must end with a slash character. Files linked out of the
+ * store are shared by every book that has them, and should not be edited. */
+int uz_unzip_epub (char* epub, char* output_dir, struct uz_filter* filter,
+                   struct uz_budget* budget, char* store, int threads,
+                   int flags);
+
+/*
+ * Inflates every entry of epub and checks its CRC-32, on up to threads
+ * threads at once, without writing anything anywhere. Entries that fail are
+ * reported as they are found. budget may be NULL for no caps, flags are as for
+ * uz_open_epub. If epub is "-", it is read off stdin in full first. Returns -1
+ * if any entry failed, or entries had to be recovered from a damaged archive.
+ */
+int uz_test_epub(char* epub, struct uz_budget* budget, int threads,
+                 int flags);
+
+/*
+ * Writes epub back out to output as a new archive, mimetype first and STORED
+ * as the epub standard asks, then every other entry in the order they were
+ * in. Entries are deflated at level, 0 to 9, on up to threads threads at
+ * once, and each is written the smallest of deflated, as it was, or STORED.
+ * Only entries keep is set for are written, keep holds a flag per entry, or
+ * is NULL to write them all. The archive is only renamed to output once
+ * complete, so output may be the epub itself. Unpacked epubs are refused.
+ */
+int uz_repack_epub(struct uz_epub* epub, char* output, char* keep, int level,
+                   int threads);
+
+/*
+ * Opens epub for reading its entries into memory. Entries large enough to be
+ * worth it are inflated on up to threads threads at once. flags is 0 or any
+ * of UZ_CHECK_RENDERED and UZ_RECOVER. If the central directory cannot be
+ * read, entries are recovered from their local headers, in one pass over the
+ * whole archive. epub can also be a directory an epub was unpacked into,
+ * its files are then read as entries, without any CRC-32 to check. Returns
+ * NULL on failure.
+ */
+/* NOTE: Should be closed using uz_close_epub when no longer in use. */
+struct uz_epub* uz_open_epub(char* epub, int threads, int flags);
+
+/*
+ * Opens the epub being read off fd, a pipe or anything else that cannot seek,
+ * for reading its entries one by one with uz_next_entry. threads and flags are
+ * as for uz_open_epub. Returns NULL on failure.
+ */
+/* NOTE: Should be closed using uz_close_epub when no longer in use. fd is
+ * left open. */
+struct uz_epub* uz_open_stream(int fd, int threads, int flags);
+
+/*
+ * Sets the caps on what entries read from epub from now on may inflate to.
+ * Reading an entry fails once it would go over them. Nothing is capped until
+ * this is called.
+ */
+void uz_set_budget(struct uz_epub* epub, struct uz_budget* budget);
+
+/*
+ * Reads the next entry off an epub opened with uz_open_stream, from its local
+ * header and data descriptor, and writes its index to index. From then on it
+ * can be looked up and read like any entry of an epub opened with
+ * uz_open_epub. Returns 1 if an entry was read, 0 once there are none left, -1
+ * if the stream could not be read or is not a valid epub.
+ */
+int uz_next_entry(struct uz_epub* epub, int* index);
+
+/*
+ * Frees the data of an entry read off a stream once it is no longer needed.
+ * The entry can still be looked up, but no longer read.
+ */
+void uz_drop_entry(struct uz_epub* epub, int index);
+
+/*
+ * Asks the kernel to start reading the n entries at indexes ahead of time, in
+ * the order they lie in the archive rather than the order given, so that they
+ * can then be read in any order without seeking back and forth. Indexes of -1
+ * are skipped. Does nothing for epubs that are not mapped archives.
+ */
+void uz_prefetch(struct uz_epub* epub, int* indexes, int n);
+
+/*
+ * Reports how much memory the epub's central directory takes up. Streams and
+ * unpacked epubs have no central directory, all of it is then 0.
+ */
+void uz_memory_use(struct uz_epub* epub, struct uz_memory* mem);
+
+/*
+ * Number of entries in the epub's central directory, or read off its stream
+ * so far. Unpacked epubs only count the files looked up so far.
+ */
+int uz_entry_count(struct uz_epub* epub);
+
+/*
+ * Describes the entry at index without reading any of its data. Returns -1 if
+ * there is no such entry.
+ */
+/* NOTE: info->name belongs to the epub, it is freed by uz_close_epub */
+int uz_entry_info(struct uz_epub* epub, int index, struct uz_info* info);
+
+/*
+ * Looks name up in the epub's central directory, or among the entries read off
+ * its stream so far. Returns the index of its
+ * entry, or -1 if there is no such entry.
+ */
+int uz_locate_entry(struct uz_epub* epub, char* name);
+
+/*
+ * Inflates the entry at index straight into a null-terminated heap buffer,
+ * its size is written to size. Returns NULL if the entry could not be read.
+ * STORED entries are not copied at all: they are given their own copy-on-write
+ * mapping of the archive and mapped is set. Mapped entries are not
+ * null-terminated and may be written to, but only within size bytes.
+ */
+/* NOTE: Returned buffer should be freed using free, or uz_unmap_entry if
+ * mapped is set, when no longer in use. */
+char* uz_read_entry(struct uz_epub* epub, int index, size_t* size,
+                    int* mapped);
+
+/*
+ * Inflates the entry at index piece by piece, handing each piece to func as
+ * soon as it is inflated. Pieces are at most 256 KB, so memory use does not
+ * grow with the entry's size, unless the entry is large enough to be inflated
+ * in full on several threads. STORED entries
+ * are handed over straight out of the archive's mapping. func returns -1 to
+ * stop early. The entry's CRC-32 is always checked, whatever the epub's flags.
+ * Returns -1 if the entry could not be read in full.
+ */
+int uz_stream_entry(struct uz_epub* epub, int index,
+                    int (*func)(char* buf, size_t len, void* opaque),
+                    void* opaque);
+
+/* Unmaps a mapped entry returned by uz_read_entry */
+void uz_unmap_entry(char* entry, size_t size);
+
+/* Closes an epub opened with uz_open_epub */
+void uz_close_epub(struct uz_epub* epub);
+
+/*
+ * Resolves "." and ".." path components and duplicate slashes in an archive
+ * path, in place. Leading ".." components that would escape the archive root
+ * are dropped.
+ */
+void uz_clean_path(char* path);
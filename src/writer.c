@@ -0,0 +1,635 @@
+/*
+ * Batched writing of extracted files through an io_uring, set up with the
+ * raw syscalls so there is nothing extra to link against.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "writer.h"
+
+/*
+ * IORING_FEAT_RW_CUR_POS came in with the kernel that added the openat and
+ * close operations, which this needs on top of plain writes.
+ */
+#if defined(__linux__) && !defined(EBREAD_NO_IO_URING)
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  include <linux/io_uring.h>
+#  if defined(SYS_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#    define HAVE_IO_URING
+#  endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+/*
+ * Most operations a ring has queued or in flight at once, counting a write
+ * for every buffer in use and an open and close for every file not closed.
+ * Both the submission and completion queues have room for all of them, so
+ * neither ever runs out.
+ */
+#define WR_DEPTH 64
+
+/* Buffers a ring copies writes into, and how many bytes each holds. */
+#define WR_BUFS     32
+#define WR_BUF_SIZE (128 * 1024)
+
+/* What a completion is for, kept in the low bits of its user_data */
+#define TAG_WRITE 0x0
+#define TAG_OPEN  0x1
+#define TAG_CLOSE 0x2
+#define TAG_MASK  0x3
+
+/* A write of one buffer to a file. */
+struct wr_op {
+	struct wr_file* file;
+	/* Next op on the free list, or waiting on the same file to open */
+	struct wr_op* next;
+	uint8_t* buf;
+	size_t len;
+	/* Bytes already written, short writes are queued again for the rest */
+	size_t done;
+	uint64_t ofs;
+};
+
+struct wr_file {
+	char* path;
+	char* name;
+	/* -1 until the open completes */
+	int fd;
+	int opened;
+	int closing;
+	int failed;
+	/* Buffer being filled, not queued yet */
+	struct wr_op* cur;
+	/* Writes queued before the open completed, waiting on it */
+	struct wr_op* held;
+	struct wr_op** heldtail;
+	/* Writes queued or held that have not completed */
+	int pending;
+	/* Where the next byte written goes */
+	uint64_t ofs;
+};
+
+struct wr_ring {
+	int fd;
+	/* Submission queue, sq_tail is ours until published in *sq_tailp */
+	unsigned* sq_tailp;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned sq_tail;
+	struct io_uring_sqe* sqes;
+	/* Completion queue */
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+	/* Mappings of the above, cq_map may be sq_map */
+	void* sq_map;
+	size_t sq_mapsize;
+	void* cq_map;
+	size_t cq_mapsize;
+	size_t sqes_size;
+	/* Operations filled in but not submitted yet */
+	unsigned queued;
+	/* Operations counted against WR_DEPTH, see WR_DEPTH */
+	unsigned reserved;
+	struct wr_op ops[WR_BUFS];
+	struct wr_op* free;
+	uint8_t* pool;
+	/* Set once any file failed, or the ring itself did */
+	int failed;
+	int broken;
+};
+
+/* Room in the submission queue is always there, see WR_DEPTH */
+static struct io_uring_sqe*
+_get_sqe(struct wr_ring* ring, void* data, int tag) {
+
+	unsigned idx = ring->sq_tail & *ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uintptr_t) data | tag;
+	ring->sq_array[idx] = idx;
+	ring->sq_tail++;
+	ring->queued++;
+
+	return sqe;
+
+}
+
+static void
+_queue_open(struct wr_ring* ring, struct wr_file* file, int dirfd) {
+
+	struct io_uring_sqe* sqe = _get_sqe(ring, file, TAG_OPEN);
+
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t) file->path;
+	sqe->len = 0666;
+	sqe->open_flags = O_WRONLY | O_CREAT | O_EXCL;
+
+}
+
+static void
+_queue_write(struct wr_ring* ring, struct wr_op* op) {
+
+	struct io_uring_sqe* sqe = _get_sqe(ring, op, TAG_WRITE);
+
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = op->file->fd;
+	sqe->addr = (uintptr_t) (op->buf + op->done);
+	sqe->len = op->len - op->done;
+	sqe->off = op->ofs + op->done;
+
+}
+
+static void
+_queue_close(struct wr_ring* ring, struct wr_file* file) {
+
+	struct io_uring_sqe* sqe = _get_sqe(ring, file, TAG_CLOSE);
+
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = file->fd;
+
+}
+
+static void
+_fail(struct wr_ring* ring, struct wr_file* file, char* what) {
+
+	if (!file->failed) {
+		fprintf(stderr, "%s: Could not %s\n", file->name, what);
+	}
+
+	file->failed = 1;
+	ring->failed = 1;
+
+}
+
+static void
+_release_op(struct wr_ring* ring, struct wr_op* op) {
+
+	op->next = ring->free;
+	ring->free = op;
+	ring->reserved--;
+
+}
+
+/*
+ * Closes the file once it is closing and nothing is left to write. A file
+ * that never opened has nothing to close, its close is let go of then.
+ */
+static void
+_settle(struct wr_ring* ring, struct wr_file* file) {
+
+	if (!file->closing || !file->opened || file->pending > 0) {
+		return;
+	}
+
+	if (file->fd != -1) {
+		_queue_close(ring, file);
+		return;
+	}
+
+	ring->reserved--;
+	free(file);
+
+}
+
+static void
+_complete_open(struct wr_ring* ring, struct wr_file* file, int res) {
+
+	struct wr_op* op;
+
+	file->opened = 1;
+	ring->reserved--;
+
+	if (res < 0) {
+		_fail(ring, file, "create");
+	} else {
+		file->fd = res;
+	}
+
+	while ((op = file->held) != NULL) {
+		file->held = op->next;
+		if (file->failed) {
+			file->pending--;
+			_release_op(ring, op);
+		} else {
+			_queue_write(ring, op);
+		}
+	}
+
+	_settle(ring, file);
+
+}
+
+static void
+_complete_write(struct wr_ring* ring, struct wr_op* op, int res) {
+
+	struct wr_file* file = op->file;
+
+	if (res <= 0) {
+		_fail(ring, file, "write");
+	} else if ((op->done += res) < op->len) {
+		_queue_write(ring, op);
+		return;
+	}
+
+	file->pending--;
+	_release_op(ring, op);
+	_settle(ring, file);
+
+}
+
+static void
+_complete_close(struct wr_ring* ring, struct wr_file* file, int res) {
+
+	if (res < 0) {
+		_fail(ring, file, "write");
+	}
+
+	ring->reserved--;
+	free(file);
+
+}
+
+/*
+ * Submits what is queued and waits for at least one operation to complete,
+ * then handles every completion there is.
+ */
+static int
+_wait(struct wr_ring* ring) {
+
+	unsigned head, tail;
+	struct io_uring_cqe* cqe;
+	int ret;
+
+	if (ring->broken) {
+		return -1;
+	}
+
+	__atomic_store_n(ring->sq_tailp, ring->sq_tail, __ATOMIC_RELEASE);
+
+	while ((ret = syscall(SYS_io_uring_enter, ring->fd, ring->queued, 1,
+		IORING_ENTER_GETEVENTS, NULL, 0)) == -1 && errno == EINTR) {
+		;
+	}
+
+	if (ret == -1) {
+		fprintf(stderr, "Could not write files\n");
+		ring->broken = 1;
+		ring->failed = 1;
+		return -1;
+	}
+
+	ring->queued -= ret;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+
+		cqe = &ring->cqes[head & *ring->cq_mask];
+
+		switch (cqe->user_data & TAG_MASK) {
+		case TAG_OPEN:
+			_complete_open(ring, (struct wr_file*) (uintptr_t)
+				(cqe->user_data & ~(uint64_t) TAG_MASK), cqe->res);
+			break;
+		case TAG_CLOSE:
+			_complete_close(ring, (struct wr_file*) (uintptr_t)
+				(cqe->user_data & ~(uint64_t) TAG_MASK), cqe->res);
+			break;
+		default:
+			_complete_write(ring, (struct wr_op*) (uintptr_t) cqe->user_data,
+				cqe->res);
+			break;
+		}
+
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return 0;
+
+}
+
+/* Waits until n more operations fit within WR_DEPTH */
+static int
+_reserve(struct wr_ring* ring, unsigned n) {
+
+	while (ring->reserved + n > WR_DEPTH) {
+		if (_wait(ring) == -1) {
+			return -1;
+		}
+	}
+
+	ring->reserved += n;
+
+	return 0;
+
+}
+
+/* Queues the file's current buffer, or holds it until the file is open. */
+static void
+_flush(struct wr_ring* ring, struct wr_file* file) {
+
+	struct wr_op* op = file->cur;
+
+	if (op == NULL) {
+		return;
+	}
+
+	file->cur = NULL;
+
+	if (file->failed) {
+		_release_op(ring, op);
+		return;
+	}
+
+	file->pending++;
+
+	if (file->fd != -1) {
+		_queue_write(ring, op);
+	} else if (!file->opened) {
+		op->next = NULL;
+		*file->heldtail = op;
+		file->heldtail = &op->next;
+	}
+
+}
+
+struct wr_ring*
+wr_open(void) {
+
+	struct wr_ring* ring;
+	struct io_uring_params params;
+	uint8_t* sq;
+	uint8_t* cq;
+
+	if ((ring = calloc(1, sizeof(struct wr_ring))) == NULL) {
+		return NULL;
+	}
+
+	memset(&params, 0, sizeof(params));
+
+	ring->sq_map = MAP_FAILED;
+	ring->cq_map = MAP_FAILED;
+	ring->sqes = MAP_FAILED;
+	ring->fd = syscall(SYS_io_uring_setup, WR_DEPTH, &params);
+
+	/* Kernels without it, or containers that block it, get plain writes */
+	if (ring->fd == -1 || !(params.features & IORING_FEAT_RW_CUR_POS)) {
+		wr_free(ring);
+		return NULL;
+	}
+
+	ring->sq_mapsize = params.sq_off.array + params.sq_entries
+		* sizeof(unsigned);
+	ring->cq_mapsize = params.cq_off.cqes + params.cq_entries
+		* sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_mapsize > ring->sq_mapsize) {
+			ring->sq_mapsize = ring->cq_mapsize;
+		}
+		ring->cq_mapsize = 0;
+	}
+
+	ring->sq_map = mmap(NULL, ring->sq_mapsize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+	if (ring->cq_mapsize == 0) {
+		ring->cq_map = ring->sq_map;
+	} else {
+		ring->cq_map = mmap(NULL, ring->cq_mapsize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	}
+
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	ring->pool = malloc((size_t) WR_BUFS * WR_BUF_SIZE);
+
+	if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED
+		|| ring->sqes == MAP_FAILED || ring->pool == NULL) {
+		wr_free(ring);
+		return NULL;
+	}
+
+	sq = ring->sq_map;
+	cq = ring->cq_map;
+
+	ring->sq_tailp = (unsigned*) (sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+	ring->sq_tail = *ring->sq_tailp;
+	ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+	for (int i = 0; i < WR_BUFS; i++) {
+		ring->ops[i].buf = ring->pool + (size_t) i * WR_BUF_SIZE;
+		ring->ops[i].next = ring->free;
+		ring->free = &ring->ops[i];
+	}
+
+	return ring;
+
+}
+
+struct wr_file*
+wr_create(struct wr_ring* ring, int dirfd, char* path, char* name) {
+
+	struct wr_file* file;
+
+	/*
+	 * A file already at path is removed rather than written through, as it
+	 * may be a hard link that other files share.
+	 */
+	if (unlinkat(dirfd, path, 0) == -1 && errno != ENOENT) {
+		return NULL;
+	}
+
+	/* Its close is counted from the start, so it always has room */
+	if (_reserve(ring, 2) == -1) {
+		return NULL;
+	}
+
+	if ((file = calloc(1, sizeof(struct wr_file))) == NULL) {
+		ring->reserved -= 2;
+		return NULL;
+	}
+
+	file->path = path;
+	file->name = name;
+	file->fd = -1;
+	file->heldtail = &file->held;
+
+	_queue_open(ring, file, dirfd);
+
+	return file;
+
+}
+
+int
+wr_write(struct wr_ring* ring, struct wr_file* file, char* buf,
+         size_t len) {
+
+	struct wr_op* op;
+	size_t n;
+
+	while (len > 0 && !file->failed) {
+
+		if (file->cur != NULL && file->cur->len == WR_BUF_SIZE) {
+			_flush(ring, file);
+		}
+
+		if (file->cur == NULL) {
+			while (ring->free == NULL) {
+				if (_wait(ring) == -1) {
+					return -1;
+				}
+			}
+			if (_reserve(ring, 1) == -1) {
+				return -1;
+			}
+			op = ring->free;
+			ring->free = op->next;
+			op->file = file;
+			op->len = 0;
+			op->done = 0;
+			op->ofs = file->ofs;
+			file->cur = op;
+		}
+
+		op = file->cur;
+		n = WR_BUF_SIZE - op->len < len ? WR_BUF_SIZE - op->len : len;
+
+		memcpy(op->buf + op->len, buf, n);
+		op->len += n;
+		file->ofs += n;
+		buf += n;
+		len -= n;
+
+	}
+
+	return file->failed ? -1 : 0;
+
+}
+
+int
+wr_close(struct wr_ring* ring, struct wr_file* file) {
+
+	int failed = file->failed;
+
+	_flush(ring, file);
+	file->closing = 1;
+	_settle(ring, file);
+
+	return failed ? -1 : 0;
+
+}
+
+int
+wr_finish(struct wr_ring* ring) {
+
+	while (ring->reserved > 0) {
+		if (_wait(ring) == -1) {
+			return -1;
+		}
+	}
+
+	return ring->failed ? -1 : 0;
+
+}
+
+void
+wr_free(struct wr_ring* ring) {
+
+	if (ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) {
+		munmap(ring->cq_map, ring->cq_mapsize);
+	}
+	if (ring->sq_map != MAP_FAILED) {
+		munmap(ring->sq_map, ring->sq_mapsize);
+	}
+	if (ring->fd != -1) {
+		close(ring->fd);
+	}
+	free(ring->pool);
+	free(ring);
+
+}
+
+#else
+
+struct wr_ring*
+wr_open(void) {
+
+	return NULL;
+
+}
+
+struct wr_file*
+wr_create(struct wr_ring* ring, int dirfd, char* path, char* name) {
+
+	(void) ring;
+	(void) dirfd;
+	(void) path;
+	(void) name;
+
+	return NULL;
+
+}
+
+int
+wr_write(struct wr_ring* ring, struct wr_file* file, char* buf,
+         size_t len) {
+
+	(void) ring;
+	(void) file;
+	(void) buf;
+	(void) len;
+
+	return -1;
+
+}
+
+int
+wr_close(struct wr_ring* ring, struct wr_file* file) {
+
+	(void) ring;
+	(void) file;
+
+	return -1;
+
+}
+
+int
+wr_finish(struct wr_ring* ring) {
+
+	(void) ring;
+
+	return -1;
+
+}
+
+void
+wr_free(struct wr_ring* ring) {
+
+	(void) ring;
+
+}
+
+#endif
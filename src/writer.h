@@ -0,0 +1,55 @@
+/*
+ * Batched writing of extracted files. Files are created, written and closed
+ * through an io_uring, so a worker extracting many small files makes one
+ * syscall for many of them, and goes on inflating while they are written.
+ */
+
+/* A worker's queue of file operations, see wr_open. */
+struct wr_ring;
+
+/* A file being created and written through a ring. */
+struct wr_file;
+
+/*
+ * Sets up a ring. Returns NULL where io_uring is not available, such as on
+ * other systems, older kernels or when it was left out of the build, in which
+ * case files should be written with plain write(2) instead.
+ */
+/* NOTE: Should be freed using wr_free when no longer in use. */
+struct wr_ring* wr_open(void);
+
+/*
+ * Queues creating the file at path, relative to dirfd, as a new file. A file
+ * already there is removed first, never written to. name is what errors about
+ * it are reported under. Returns NULL if memory could not be allocated or the
+ * file already there could not be removed.
+ */
+/* NOTE: path and name must stay valid until the file is closed and wr_finish
+ * has returned. */
+struct wr_file* wr_create(struct wr_ring* ring, int dirfd, char* path,
+                          char* name);
+
+/*
+ * Queues appending len bytes at buf to file, buf is copied and can be reused
+ * once this returns. Returns -1 if the file could not be created or written,
+ * as far as is known yet.
+ */
+int wr_write(struct wr_ring* ring, struct wr_file* file, char* buf,
+             size_t len);
+
+/*
+ * Queues closing file once everything queued for it is written. The ring
+ * frees file after that. Returns -1 if the file could not be created or
+ * written, as far as is known yet.
+ */
+int wr_close(struct wr_ring* ring, struct wr_file* file);
+
+/*
+ * Waits for everything queued on the ring. Returns -1 if any of its files
+ * could not be created, written or closed, which were reported as they failed.
+ */
+/* NOTE: Every file should be closed with wr_close first. */
+int wr_finish(struct wr_ring* ring);
+
+/* Frees a ring set up with wr_open, after waiting with wr_finish */
+void wr_free(struct wr_ring* ring);
@@ -3,8 +3,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "xml.h"
 
+/*
+ * Bytes a tree's arena sets aside per '<' in its content, enough for the node
+ * a tag makes, the text node after it and a few props.
+ */
+#define NODE_ROOM 192
+
 /* Used to initialize newly created nodes */
 static struct xml_tree_node null_node = {
 	.name = NULL,
@@ -12,48 +19,56 @@ static struct xml_tree_node null_node = {
 	.prev = NULL,
 	.parent = NULL,
 	.child = NULL,
+	.lastchild = NULL,
 	.traverse = NULL,
 	.props = NULL,
 	.text = NULL,
 	.content_ptr = NULL,
+	.content_owned = 0,
+	.arena = NULL,
 };
 
-/* Reads the entire file into a string. */
+/* Replace tabs, newlines, etc. with spaces */
+static void
+_normalize_space(char* content, size_t size) {
+
+	for (char* p = content; p < content + size; p++) {
+		if (isspace(*p)) {
+			*p = ' ';
+		}
+	}
+
+}
+
+/*
+ * Like strtok(NULL, "<"), but bounded by end rather than a null terminator, so
+ * the content does not need to be null-terminated. The end of the token is
+ * written to tokend. Returns NULL once there are no tokens left.
+ */
 static char*
-_read_xml_file(char* xml) {
+_next_token(char** pos, char* end, char** tokend) {
 
-	FILE* xmlf = fopen(xml, "r");
-	long size;
-	char* read;
+	char* tok = *pos;
+	char* lt;
 
-	if (xmlf == NULL) {
-		fprintf(stderr, "%s: Could not open\n", xml);
-		return NULL;
+	while (tok < end && *tok == '<') {
+		tok++;
 	}
 
-	/* Get the file size */
-	fseek(xmlf, 0, SEEK_END);
-	size = ftell(xmlf);
-	rewind(xmlf);
-
-	/* Read the entire file into read and add null terminator */
-	if ((read = malloc(sizeof(char) * size + 1)) == NULL) {
-		fprintf(stderr, "Could not allocate memory\n");
-		fclose(xmlf);
+	if (tok == end) {
 		return NULL;
 	}
-	fread(read, sizeof(char), size, xmlf);
-	read[size] = '\0';
 
-	/* Replace tabs, newlines, etc. with spaces */
-	for (char* p = read; *p != '\0'; p++) {
-		if (isspace(*p)) {
-			*p = ' ';
-		}
+	if ((lt = memchr(tok, '<', end - tok)) == NULL) {
+		*tokend = end;
+		*pos = end;
+	} else {
+		*lt = '\0';
+		*tokend = lt;
+		*pos = lt + 1;
 	}
 
-	fclose(xmlf);
-	return read;
+	return tok;
 
 }
 
@@ -73,7 +88,7 @@ _is_end_tag(char* tag, struct xml_tree_node* node) {
 }
 
 static struct xml_prop*
-_parse_props(char* propstr) {
+_parse_props(struct arena* arena, char* propstr) {
 
 	struct xml_prop* props;
 	int propnum = 0;
@@ -114,7 +129,9 @@ _parse_props(char* propstr) {
 
 	}
 
-	if ((props = malloc(sizeof(struct xml_prop) * (propnum + 1))) == NULL) {
+	props = arena_alloc(arena, sizeof(struct xml_prop) * (propnum + 1));
+
+	if (props == NULL) {
 		fprintf(stderr, "Could not allocate memory\n");
 		return NULL;
 	}
@@ -146,7 +163,7 @@ _parse_props(char* propstr) {
 }
 
 static int
-_parse_tag(char* tag, struct xml_tree_node* node) {
+_parse_tag(struct arena* arena, char* tag, struct xml_tree_node* node) {
 
 	char* name;
 	char* attributes;
@@ -168,7 +185,7 @@ _parse_tag(char* tag, struct xml_tree_node* node) {
 	if (*attributes == '\0') {
 		node->props = NULL;
 	} else {
-		if ((node->props = _parse_props(attributes)) == NULL) {
+		if ((node->props = _parse_props(arena, attributes)) == NULL) {
 			return -1;
 		}
 	}
@@ -178,13 +195,14 @@ _parse_tag(char* tag, struct xml_tree_node* node) {
 }
 
 static struct xml_tree_node*
-_make_child_node(struct xml_tree_node* parent) {
+_make_child_node(struct arena* arena, struct xml_tree_node* parent) {
 
 	struct xml_tree_node* rtrn = parent;
 
 	/* Create initial child node if it does not exist */
 	if (rtrn->child == NULL) {
-		if ((rtrn->child = malloc(sizeof(struct xml_tree_node))) == NULL) {
+		rtrn->child = arena_alloc(arena, sizeof(struct xml_tree_node));
+		if (rtrn->child == NULL) {
 			return NULL;
 		}
 		*(rtrn->child) = null_node;
@@ -192,11 +210,9 @@ _make_child_node(struct xml_tree_node* parent) {
 		rtrn = rtrn->child;
 	/* Add new child node at the end of child node line */
 	} else {
-		rtrn = rtrn->child;
-		while (rtrn->next != NULL) {
-			rtrn = rtrn->next;
-		}
-		if ((rtrn->next = malloc(sizeof(struct xml_tree_node))) == NULL) {
+		rtrn = rtrn->lastchild;
+		rtrn->next = arena_alloc(arena, sizeof(struct xml_tree_node));
+		if (rtrn->next == NULL) {
 			return NULL;
 		}
 		*(rtrn->next) = null_node;
@@ -205,6 +221,8 @@ _make_child_node(struct xml_tree_node* parent) {
 		rtrn = rtrn->next;
 	}
 
+	parent->lastchild = rtrn;
+
 	return rtrn;
 
 }
@@ -241,64 +259,91 @@ _build_traverse_line(struct xml_tree_node* head) {
 void
 xml_free_tree(struct xml_tree_node* head) {
 
-	struct xml_tree_node *cur, *next;
+	if (head->content_owned) {
+		free(head->content_ptr);
+	}
+
+	/* The head is in the arena too, along with every node and prop */
+	arena_free(head->arena);
 
-	free(head->content_ptr);
+}
 
-	cur = head;
+/*
+ * Sizes a tree's arena from the number of tags in its content, so that it
+ * usually fits in the one chunk.
+ */
+static struct arena*
+_make_tree_arena(char* xml, size_t size) {
 
-	while (cur != NULL) {
-		next = cur->traverse;
-		if (cur->props != NULL) {
-			free(cur->props);
-		}
-		free(cur);
-		cur = next;
+	char* end = xml + size;
+	size_t tags = 1;
+
+	for (char* p = xml; (p = memchr(p, '<', end - p)) != NULL; p++) {
+		tags++;
 	}
 
+	return arena_new(tags * NODE_ROOM);
+
 }
 
 struct xml_tree_node*
-xml_build_tree(char* xml) {
+xml_build_tree(char* xml, size_t size, int owned) {
 
-	struct xml_tree_node* head;
-	char* xml_content;
+	struct arena* arena;
+	struct xml_tree_node* head = NULL;
 	struct xml_tree_node* cur;
-	char* curtok;
+	char* end = xml + size;
+	char *pos, *tokend;
 	char *text, *tag;
 
-	if ((xml_content = _read_xml_file(xml)) == NULL) {
-		fprintf(stderr, "%s: Could not parse\n", xml);
-		return NULL;
-	}
-
-	if ((head = malloc(sizeof(struct xml_tree_node))) == NULL) {
+	/* Every node is bumped off the arena, freeing the tree frees it whole */
+	if ((arena = _make_tree_arena(xml, size)) == NULL
+		|| (head = arena_alloc(arena, sizeof(struct xml_tree_node))) == NULL) {
 		fprintf(stderr, "Could not allocate memory\n");
-		free(xml_content);
+		if (arena != NULL) {
+			arena_free(arena);
+		}
+		if (owned) {
+			free(xml);
+		}
 		return NULL;
 	}
 
+	_normalize_space(xml, size);
+
 	*head = null_node;
-	head->content_ptr = xml_content;
+	head->content_ptr = xml;
+	head->content_owned = owned;
+	head->arena = arena;
 	cur = head;
 
-	curtok = strtok(head->content_ptr, "<");
+	pos = xml;
 
-	do {
+	while ((tag = _next_token(&pos, end, &tokend)) != NULL) {
 
-		tag = curtok;
-		if ((text = strchr(tag, '>')) == NULL) {
+		if ((text = memchr(tag, '>', tokend - tag)) == NULL) {
 			continue;
 		}
 		*text = '\0';
 		text++;
 
-		while (*text == ' ') {
+		while (text < tokend && *text == ' ') {
 			text++;
 		}
 
-		if (*text == '\0') {
+		/*
+		 * Text running up to the end of unowned content has no null
+		 * terminator. Use the content's trailing space if there is one,
+		 * otherwise the text lies outside of the root node and is dropped.
+		 */
+		if (text == tokend || *text == '\0') {
 			text = NULL;
+		} else if (tokend == end && !owned) {
+			if (*(end - 1) == ' ') {
+				*(end - 1) = '\0';
+			} else {
+				text = NULL;
+			}
 		}
 
 		/* Ignore comments, CDATA, and PIs */
@@ -309,39 +354,38 @@ xml_build_tree(char* xml) {
 			cur = cur->parent;
 		/* Single tag node */
 		} else if (*(strchr(tag, '\0') - 1) == '/') {
-			if ((cur = _make_child_node(cur)) == NULL) {
+			if ((cur = _make_child_node(arena, cur)) == NULL) {
 				goto die;
 			}
-			if (_parse_tag(tag, cur) == -1) {
+			if (_parse_tag(arena, tag, cur) == -1) {
 				goto die;
 			}
 			cur = cur->parent;
 		/* New child node */
 		} else {
-			if ((cur = _make_child_node(cur)) == NULL) {
+			if ((cur = _make_child_node(arena, cur)) == NULL) {
 				goto die;
 			}
-			if (_parse_tag(tag, cur) == -1) {
+			if (_parse_tag(arena, tag, cur) == -1) {
 				goto die;
 			}
 		}
 
 		if (text != NULL) {
-			if ((cur = _make_child_node(cur)) == NULL) {
+			if ((cur = _make_child_node(arena, cur)) == NULL) {
 				goto die;
 			}
 			cur->text = text;
 			cur = cur->parent;
 		}
 
-	} while ((curtok = strtok(NULL, "<")) != NULL);
+	}
 
 	_build_traverse_line(head);
 
 	return head;
 
 die:
-	_build_traverse_line(head);
 	xml_free_tree(head);
 	return NULL;
 
@@ -371,3 +415,264 @@ xml_strcmpnul(char* s1, char* s2) {
 	return strcmp(s1, s2);
 
 }
+
+void
+xml_stream_init(struct xml_stream* stream,
+                int (*node_cb)(struct xml_stream* stream),
+                int (*text_cb)(struct xml_stream* stream, char* text),
+                void* data) {
+
+	stream->node_cb = node_cb;
+	stream->text_cb = text_cb;
+	stream->data = data;
+	stream->nodes = NULL;
+	stream->nodenum = 0;
+	stream->nodecap = 0;
+	stream->nextid = 1;
+	/* Like strtok, content before the first '<' is read as a tag. */
+	stream->state = XML_IN_TAG;
+	stream->taglen = 0;
+	stream->taglast = '\0';
+	stream->text = NULL;
+	stream->textlen = 0;
+	stream->textcap = 0;
+
+}
+
+static int
+_stream_push(struct xml_stream* stream, char* name) {
+
+	if (stream->nodenum == stream->nodecap) {
+
+		struct xml_stream_node* nodes;
+		int cap = (stream->nodecap == 0) ? 32 : stream->nodecap * 2;
+
+		nodes = realloc(stream->nodes, sizeof(struct xml_stream_node) * cap);
+
+		if (nodes == NULL) {
+			fprintf(stderr, "Could not allocate memory\n");
+			return -1;
+		}
+
+		stream->nodes = nodes;
+		stream->nodecap = cap;
+
+	}
+
+	if ((stream->nodes[stream->nodenum].name = strdup(name)) == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		return -1;
+	}
+
+	stream->nodes[stream->nodenum].id = stream->nextid++;
+	stream->nodenum++;
+
+	return stream->node_cb(stream);
+
+}
+
+static void
+_stream_pop(struct xml_stream* stream) {
+
+	free(stream->nodes[--stream->nodenum].name);
+
+}
+
+/* Same rules as the tag handling in xml_build_tree, see _parse_tag. */
+static int
+_stream_tag(struct xml_stream* stream) {
+
+	char* tag = stream->tag;
+	char* name;
+	int single;
+
+	tag[stream->taglen] = '\0';
+
+	/* Ignore comments, CDATA, and PIs */
+	if (*tag == '!' || *tag == '?') {
+		return 0;
+	}
+
+	/* Current node has now ended, return to parent */
+	if (*tag == '/' && stream->nodenum > 0
+		&& strcmp(tag + 1, stream->nodes[stream->nodenum - 1].name) == 0) {
+		_stream_pop(stream);
+		return 0;
+	}
+
+	/* Get rid of trailing slash (for single-tag nodes) */
+	if ((single = (stream->taglast == '/')) && tag[stream->taglen - 1] == '/') {
+		tag[stream->taglen - 1] = '\0';
+	}
+
+	name = tag + strspn(tag, " ");
+	*(name + strcspn(name, " ")) = '\0';
+
+	if (_stream_push(stream, name) == -1) {
+		return -1;
+	}
+
+	if (single) {
+		_stream_pop(stream);
+	}
+
+	return 0;
+
+}
+
+/* Hands text up to and including its last space to text_cb. */
+static int
+_stream_text(struct xml_stream* stream, int all) {
+
+	size_t len = stream->textlen;
+	char save;
+	int rtrn;
+
+	if (!all) {
+		while (len > 0 && stream->text[len - 1] != ' ') {
+			len--;
+		}
+	}
+
+	if (len == 0) {
+		return 0;
+	}
+
+	save = stream->text[len];
+	stream->text[len] = '\0';
+	rtrn = stream->text_cb(stream, stream->text);
+	stream->text[len] = save;
+
+	memmove(stream->text, stream->text + len, stream->textlen - len);
+	stream->textlen -= len;
+
+	return rtrn;
+
+}
+
+static int
+_stream_add_text(struct xml_stream* stream, char* buf, size_t len) {
+
+	if (stream->textlen + len + 1 > stream->textcap) {
+
+		char* text;
+		size_t cap = stream->textlen + len + 1;
+
+		if ((text = realloc(stream->text, cap)) == NULL) {
+			fprintf(stderr, "Could not allocate memory\n");
+			return -1;
+		}
+
+		stream->text = text;
+		stream->textcap = cap;
+
+	}
+
+	memcpy(stream->text + stream->textlen, buf, len);
+
+	for (size_t i = stream->textlen; i < stream->textlen + len; i++) {
+		if (isspace(stream->text[i])) {
+			stream->text[i] = ' ';
+		}
+	}
+
+	stream->textlen += len;
+
+	return 0;
+
+}
+
+int
+xml_stream_feed(struct xml_stream* stream, char* buf, size_t len) {
+
+	char* end = buf + len;
+	char* p = buf;
+	char* stop;
+
+	while (p < end) {
+
+		if (stream->state == XML_IN_TAG) {
+
+			for (; p < end && *p != '>' && *p != '<'; p++) {
+				if (stream->taglen < XML_TAG_MAX) {
+					stream->tag[stream->taglen++] = isspace(*p) ? ' ' : *p;
+				}
+				stream->taglast = isspace(*p) ? ' ' : *p;
+			}
+
+			if (p == end) {
+				break;
+			}
+
+			/* Tags without a '>' are skipped over. */
+			if (*p == '>' && _stream_tag(stream) == -1) {
+				return -1;
+			}
+
+			stream->state = (*p == '>') ? XML_IN_TEXT : XML_IN_TAG;
+			stream->taglen = 0;
+			stream->taglast = '\0';
+			p++;
+
+		} else {
+
+			/* Leading spaces of a node's text are dropped. */
+			if (stream->textlen == 0) {
+				while (p < end && isspace(*p)) {
+					p++;
+				}
+			}
+
+			if ((stop = memchr(p, '<', end - p)) == NULL) {
+				stop = end;
+			}
+
+			if (_stream_add_text(stream, p, stop - p) == -1) {
+				return -1;
+			}
+
+			p = stop;
+
+			if (p == end) {
+				break;
+			}
+
+			if (_stream_text(stream, 1) == -1) {
+				return -1;
+			}
+
+			stream->state = XML_IN_TAG;
+			p++;
+
+		}
+
+	}
+
+	/* Keep only the last unfinished word around until more content arrives. */
+	if (stream->state == XML_IN_TEXT) {
+		return _stream_text(stream, 0);
+	}
+
+	return 0;
+
+}
+
+int
+xml_stream_end(struct xml_stream* stream) {
+
+	int rtrn = 0;
+
+	if (stream->state == XML_IN_TEXT) {
+		rtrn = _stream_text(stream, 1);
+	}
+
+	while (stream->nodenum > 0) {
+		_stream_pop(stream);
+	}
+
+	free(stream->nodes);
+	free(stream->text);
+
+	return rtrn;
+
+}
@@ -1,3 +1,5 @@
+struct arena;
+
 struct xml_prop {
 	char* name;
 	char* value;
@@ -10,6 +12,8 @@ struct xml_tree_node {
 	struct xml_tree_node* prev;
 	struct xml_tree_node* parent;
 	struct xml_tree_node* child;
+	/* Last of the node's children, so new ones are added without a walk. */
+	struct xml_tree_node* lastchild;
 	/* Used if you wish to visit every node in a node tree once in DFS order. */
 	struct xml_tree_node* traverse;
 	/* Array of tag props. Last prop will have name and value set to NULL. */
@@ -19,17 +23,83 @@ struct xml_tree_node {
 	/* Points to the xml file's content's location in memory. This is only used
 	 * by a tree's head node. */
 	char* content_ptr;
+	/* Whether content_ptr is freed along with the tree. Only used by a tree's
+	 * head node. */
+	int content_owned;
+	/* Where every node of the tree and its props are allocated, released all
+	 * at once by xml_free_tree. Only used by a tree's head node. */
+	struct arena* arena;
 };
 
 /* strcmp, but if s1 or s2 are NULL, return 1. */
 int xml_strcmpnul(char* s1, char* s2);
 
-/* Builds an xml node tree, returns the tree's head. */
+/*
+ * Builds an xml node tree out of the size bytes of xml content at xml. Returns
+ * the tree's head. Parsing writes into xml, but never past size bytes, so xml
+ * does not need to be null-terminated. If owned is set, xml must be a
+ * null-terminated heap buffer and the tree takes ownership of it, even on
+ * failure. Otherwise xml must outlive the tree.
+ */
 /* NOTE: Tree head should be freed using xml_free_tree when no longer in use. */
-struct xml_tree_node* xml_build_tree(char* xml);
+struct xml_tree_node* xml_build_tree(char* xml, size_t size, int owned);
 
 /* Returns the value of propname in node, or NULL if it doesn't exist. */
 char* xml_get_prop(struct xml_tree_node* node, char* propname);
 
-/* Frees all malloc'd data in an xml node tree */
+/* Frees an xml node tree, every node of it at once */
 void xml_free_tree(struct xml_tree_node* head);
+
+/* Longest tag an xml stream keeps, longer tags are cut short. */
+#define XML_TAG_MAX 1024
+
+/* A node that has been opened but not yet closed in an xml stream. */
+struct xml_stream_node {
+	char* name;
+	/* Unique within a stream, tells apart nodes that share a name. */
+	unsigned long id;
+};
+
+/*
+ * Incremental xml tokenizer. Content is fed to it in pieces of any size, it
+ * calls node_cb for every node opened and text_cb for every piece of text, in
+ * the same order xml_build_tree's traverse line would visit them. Only the
+ * current tag and the last unfinished word of text are buffered, so memory use
+ * does not grow with the size of the content. Tag props are not parsed.
+ */
+struct xml_stream {
+	/* Called when a node is opened, it is on top of nodes by then. */
+	int (*node_cb)(struct xml_stream* stream);
+	/* Called with text of the node on top of nodes. A node's text may be cut
+	 * into several pieces, but never in the middle of a word. */
+	int (*text_cb)(struct xml_stream* stream, char* text);
+	void* data;
+	/* Nodes opened but not yet closed, the innermost one last. */
+	struct xml_stream_node* nodes;
+	int nodenum;
+	/* The rest is used internally by the tokenizer. */
+	int nodecap;
+	unsigned long nextid;
+	enum { XML_IN_TAG, XML_IN_TEXT } state;
+	char tag[XML_TAG_MAX + 1];
+	size_t taglen;
+	char taglast;
+	char* text;
+	size_t textlen;
+	size_t textcap;
+};
+
+/* Initializes stream, data is passed along to the callbacks. */
+void xml_stream_init(struct xml_stream* stream,
+                     int (*node_cb)(struct xml_stream* stream),
+                     int (*text_cb)(struct xml_stream* stream, char* text),
+                     void* data);
+
+/* Feeds the next len bytes of content to stream. Returns -1 on failure. */
+int xml_stream_feed(struct xml_stream* stream, char* buf, size_t len);
+
+/*
+ * Ends the stream, flushing any text left over, and frees everything stream
+ * allocated. Returns -1 on failure.
+ */
+int xml_stream_end(struct xml_stream* stream);